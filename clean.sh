@@ -5,6 +5,7 @@ set -e
 for PROJECT in $PROJECTS; do
   $MAKE -C $PROJECT clean
 done
+$MAKE -C host clean
 
 rm -rfv sysroot
 rm -rfv isodir
@@ -0,0 +1,5 @@
+#!/bin/sh
+set -e
+
+# Builds libk for Linux and runs its benchmarks, see host/Makefile
+${MAKE:-make} -C host bench
@@ -0,0 +1,5 @@
+#!/bin/sh
+set -e
+
+# Builds libk for Linux and runs its test suites, see host/Makefile
+${MAKE:-make} -C host test
@@ -0,0 +1,12 @@
+#include <libk/heap.h>
+#include <libk/vmem.h>
+#include <test/heap_bench.h>
+
+// Runs the heap benchmarks of kernel_early, perf can profile this binary
+int main() {
+  vmem_init();
+  kernel_heap_init();
+  bench_heap();
+  print_heap_stats();
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _HOST_HOST_H_
+#define _HOST_HOST_H_
+
+#include <stddef.h>
+
+// Linux system calls used by the hosted build of libk. There is no libc to
+// lean on, libk is built against the repo's own libc headers, so these go
+// straight through int 0x80.
+
+// Maps len bytes of anonymous memory at addr, failing if anything is there
+// already. Returns addr, or NULL on failure.
+void* host_map(void* addr, size_t len);
+void host_unmap(void* addr, size_t len);
+void host_exit(int status);
+
+#endif  // _HOST_HOST_H_
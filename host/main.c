@@ -0,0 +1,23 @@
+#include <libk/heap.h>
+#include <libk/vmem.h>
+#include <test/hashmap_test.h>
+#include <test/heap_debug_test.h>
+#include <test/heap_profile_test.h>
+#include <test/heap_test.h>
+#include <test/macros_test.h>
+#include <test/vector_test.h>
+
+// Runs the libk suites of kernel_early that don't touch the hardware. The
+// phys_mem, virt_mem and vmem suites poke at page tables and device memory,
+// so they only run in the kernel.
+int main() {
+  vmem_init();
+  kernel_heap_init();
+  test_macros();
+  test_heap();
+  test_heap_profile();
+  test_heap_debug();
+  test_vector();
+  test_hashmap();
+  return 0;
+}
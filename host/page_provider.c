@@ -0,0 +1,111 @@
+#include "host.h"
+#include <libk/phys_mem.h>
+#include <libk/virt_mem.h>
+#include <stdio.h>
+
+// Stands in for the physical and virtual memory managers of the kernel.
+// Every page libk asks for is mapped with mmap at the very same virtual
+// address it would have in the kernel, the upper gigabyte is free in a 32 bit
+// process. There is no physical memory, a page is its own block.
+
+#define HOST_PAGE_COUNT (1 << 20)  // Pages in the 4GB address space
+
+enum host_page_state {
+  HOST_PAGE_UNMAPPED = 0,
+  HOST_PAGE_MAPPED,
+  HOST_PAGE_GUARD,
+};
+
+static uint8_t host_pages_[HOST_PAGE_COUNT];
+
+bool alloc_page(virtual_addr addr) {
+  addr &= ~(PAGE_SIZE - 1);
+  if (!host_map((void*) addr, PAGE_SIZE)) {
+    printf("HOST MMAP FAILED AT %x\n", addr);
+    return false;
+  }
+  host_pages_[addr / PAGE_SIZE] = HOST_PAGE_MAPPED;
+  return true;
+}
+
+void free_page(virtual_addr addr) {
+  addr &= ~(PAGE_SIZE - 1);
+  if (host_pages_[addr / PAGE_SIZE] == HOST_PAGE_MAPPED) {
+    host_unmap((void*) addr, PAGE_SIZE);
+  }
+  host_pages_[addr / PAGE_SIZE] = HOST_PAGE_UNMAPPED;
+}
+
+// The contents of device memory can't be reached from here, the page gets
+// fresh memory instead
+bool map_page(physical_addr paddr, virtual_addr addr) {
+  (void) paddr;
+  return alloc_page(addr);
+}
+
+uint32_t virt_to_phys(virtual_addr addr) {
+  return addr;
+}
+
+bool alloc_range(virtual_addr addr, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (!alloc_page(addr + i * PAGE_SIZE)) {
+      unmap_range(addr, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool map_range(physical_addr paddr, virtual_addr addr, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (!map_page(paddr + i * PAGE_SIZE, addr + i * PAGE_SIZE)) {
+      unmap_range(addr, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool map_device_range(physical_addr paddr,
+                      virtual_addr addr,
+                      uint32_t count) {
+  return map_range(paddr, addr, count);
+}
+
+void unmap_range(virtual_addr addr, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    free_page(addr + i * PAGE_SIZE);
+  }
+}
+
+bool map_guard_page(virtual_addr addr, virtual_addr owner) {
+  (void) owner;
+  free_page(addr);
+  host_pages_[addr / PAGE_SIZE] = HOST_PAGE_GUARD;
+  return true;
+}
+
+bool is_guard_page(virtual_addr addr) {
+  return host_pages_[addr / PAGE_SIZE] == HOST_PAGE_GUARD;
+}
+
+// Nothing else lives in the range given to vmem
+void reserve_range(virtual_addr start, virtual_addr end) {
+  (void) start;
+  (void) end;
+}
+
+bool is_alloced(physical_addr addr) {
+  return host_pages_[addr / PAGE_SIZE] == HOST_PAGE_MAPPED;
+}
+
+// Blocks have no descriptors, so vmem never takes references to them
+page_t* block_to_page(physical_addr addr) {
+  (void) addr;
+  return NULL;
+}
+
+void get_block(physical_addr addr) {
+  (void) addr;
+}
@@ -0,0 +1,116 @@
+#include "host.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// i386 Linux system call numbers and flags
+#define SYS_EXIT 1
+#define SYS_WRITE 4
+#define SYS_MUNMAP 91
+#define SYS_MMAP2 192
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_PRIVATE 0x2
+#define MAP_ANONYMOUS 0x20
+#define MAP_FIXED_NOREPLACE 0x100000
+
+#define STDOUT 1
+
+static int32_t syscall6(int32_t num,
+                        int32_t arg1,
+                        int32_t arg2,
+                        int32_t arg3,
+                        int32_t arg4,
+                        int32_t arg5,
+                        int32_t arg6) {
+  int32_t ret;
+  // ebp is the frame pointer, so the sixth argument is swapped in by hand
+  asm volatile("push %%ebp\n\t"
+               "mov %7, %%ebp\n\t"
+               "int $0x80\n\t"
+               "pop %%ebp"
+               : "=a"(ret)
+               : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3), "S"(arg4),
+                 "D"(arg5), "m"(arg6)
+               : "memory");
+  return ret;
+}
+
+void* host_map(void* addr, size_t len) {
+  int32_t flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+  int32_t ret = syscall6(SYS_MMAP2, (int32_t) addr, len, PROT_READ | PROT_WRITE,
+                         flags, -1, 0);
+  // Older kernels ignore MAP_FIXED_NOREPLACE and map somewhere else
+  if ((void*) ret != addr) {
+    if ((uint32_t) ret < (uint32_t) -4095) {
+      syscall6(SYS_MUNMAP, ret, len, 0, 0, 0, 0);
+    }
+    return NULL;
+  }
+  return addr;
+}
+
+void host_unmap(void* addr, size_t len) {
+  syscall6(SYS_MUNMAP, (int32_t) addr, len, 0, 0, 0, 0);
+}
+
+void host_exit(int status) {
+  syscall6(SYS_EXIT, status, 0, 0, 0, 0, 0);
+  for (;;) {
+  }
+}
+
+// Replaces the tty backed putchar of the kernel
+int putchar(int ic) {
+  char c = (char) ic;
+  syscall6(SYS_WRITE, STDOUT, (int32_t) &c, sizeof(c), 0, 0, 0);
+  return ic;
+}
+
+// 64 bit division helpers, normally from the 32 bit libgcc. Only the 64 bit
+// one is installed on most hosts. Shift and subtract is plenty for the
+// statistics code that needs them.
+uint64_t __udivmoddi4(uint64_t num, uint64_t den, uint64_t* rem) {
+  uint64_t quot = 0;
+  uint64_t acc = 0;
+  for (int bit = 63; bit >= 0; bit--) {
+    acc = (acc << 1) | ((num >> bit) & 1);
+    if (acc >= den) {
+      acc -= den;
+      quot |= 1ull << bit;
+    }
+  }
+  if (rem) {
+    *rem = acc;
+  }
+  return quot;
+}
+
+uint64_t __udivdi3(uint64_t num, uint64_t den) {
+  return __udivmoddi4(num, den, NULL);
+}
+
+uint64_t __umoddi3(uint64_t num, uint64_t den) {
+  uint64_t rem;
+  __udivmoddi4(num, den, &rem);
+  return rem;
+}
+
+int64_t __divdi3(int64_t num, int64_t den) {
+  bool negative = (num < 0) != (den < 0);
+  uint64_t quot = __udivmoddi4(num < 0 ? -(uint64_t) num : (uint64_t) num,
+                               den < 0 ? -(uint64_t) den : (uint64_t) den,
+                               NULL);
+  return negative ? -(int64_t) quot : (int64_t) quot;
+}
+
+int64_t __moddi3(int64_t num, int64_t den) {
+  return num - __divdi3(num, den) * den;
+}
+
+int main();
+
+void _start() {
+  host_exit(main());
+}
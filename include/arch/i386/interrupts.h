@@ -2,9 +2,13 @@
 #define _INTERRUPT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#define PAGE_FAULT_IDT_INDEX 14
 #define TIMER_IDT_INDEX 32
 #define KEYBOARD_IDT_INDEX 33
+#define LAPIC_TIMER_IDT_INDEX 48
+#define LAPIC_SPURIOUS_IDT_INDEX 255
 #define SYSCALL_IDT_INDEX 128
 
 // Holds the registers at the time of the interrupt
@@ -0,0 +1,36 @@
+#ifndef _KERNEL_CLOCK_H_
+#define _KERNEL_CLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NS_PER_SECOND 1000000000ull
+// Slowest TSC the clock uses, the fixed point factor of cycles_to_ns of
+// anything slower doesn't fit in 32 bits
+#define CLOCK_MIN_TSC_KHZ 4000
+
+// Calibrates the TSC against the PIT. Runs with interrupts off, before
+// timer_install takes over PIT channel 0, as it only uses channel 2.
+void clock_install();
+
+// Nanoseconds since clock_install. Comes from the TSC, or from the timer
+// ticks with a 1 / TICKS_PER_SECOND resolution if the TSC couldn't be used.
+uint64_t now_ns();
+
+// Cycle counter for timing short sections of code, 0 without a TSC
+uint64_t now_cycles();
+
+// Converts a number of cycles of now_cycles to nanoseconds
+uint64_t cycles_to_ns(uint64_t cycles);
+
+// True if now_ns and now_cycles come from a calibrated TSC
+bool clock_has_tsc();
+
+// Frequency of the TSC in KHz, 0 without a TSC
+uint32_t clock_tsc_khz();
+
+// Helper used for tests of cycles_to_ns, which converts as if the TSC was
+// calibrated at khz afterwards. Give it back clock_tsc_khz when done.
+void force_clock_tsc_khz(uint32_t khz);
+
+#endif  // _KERNEL_CLOCK_H_
@@ -0,0 +1,22 @@
+#ifndef _KERNEL_LAPIC_H_
+#define _KERNEL_LAPIC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maps and enables the local APIC and measures the rate of its timer
+// against the TSC clock. Needs vmem and a calibrated clock. Returns false
+// if there is no local APIC or its timer can't be used.
+bool lapic_install();
+
+// Signals the end of a local APIC interrupt
+void lapic_eoi();
+
+// Fires LAPIC_TIMER_IDT_INDEX once, after count timer ticks. A count of 0
+// stops the timer.
+void lapic_timer_one_shot(uint32_t count);
+
+// Rate of the timer in KHz, 0 before lapic_install
+uint32_t lapic_timer_khz();
+
+#endif  // _KERNEL_LAPIC_H_
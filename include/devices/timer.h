@@ -1,6 +1,49 @@
 #ifndef _KERNEL_TIMER_H_
 #define _KERNEL_TIMER_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIT_FREQUENCY 1193180  // Input clock of the PIT channels, in Hz
+#define TICKS_PER_SECOND 100
+
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS 1  // interrupt at the next deadline, not periodically
+#endif
+
+typedef void (*timer_callback_t)(void* data);
+
+// An entry of the timer queue. The caller owns it, so adding one never
+// allocates and can be done from interrupt handlers.
+typedef struct timer_event_t {
+  uint64_t deadline_ns;  // now_ns value at which callback runs
+  timer_callback_t callback;
+  void* data;
+  struct timer_event_t* next;
+} timer_event_t;
+
+// Uses the local APIC timer in one-shot mode when there is one, or the PIT
+// in one-shot mode otherwise, armed for the next deadline only. Without the
+// TSC clock, or with TIMER_TICKLESS off, the PIT ticks TICKS_PER_SECOND
+// times a second and deadlines are checked at each tick.
 void timer_install();
 
-#endif  // _KERNEL_TIMER_H_
\ No newline at end of file
+// Number of 1 / TICKS_PER_SECOND periods the system has been running for
+uint32_t timer_get_ticks();
+
+// Queues event to call callback with data, with interrupts off, once
+// now_ns reaches deadline_ns. Adding an event that is already queued moves
+// it to the new deadline.
+void timer_add(timer_event_t* event,
+               uint64_t deadline_ns,
+               timer_callback_t callback,
+               void* data);
+
+// Takes event off the queue. Returns false if it wasn't queued.
+bool timer_cancel(timer_event_t* event);
+
+// Helper used for tests of the timer queue. Returns the event with the
+// soonest deadline, the rest follow through next.
+timer_event_t* timer_first_event();
+
+#endif  // _KERNEL_TIMER_H_
@@ -0,0 +1,61 @@
+#ifndef _LIBK_BITMAP_H_
+#define _LIBK_BITMAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bitmaps shared by the memory allocators. A bitmap is an array of 32 bit
+// words where bit n lives in word n / 32, at position n % 32. Searches work
+// a word at a time: full (or empty) words are skipped with one compare and
+// the bit we look for inside a word is found with a single bsf/bsr.
+//
+// Functions taking num_bits never look past it, so the unused bits of the
+// last word can hold anything.
+
+#define BITMAP_WORD_BITS 32
+#define BITMAP_FULL_WORD 0xFFFFFFFF
+#define BITMAP_WORDS_NEED_FOR_N_BITS(n) \
+  (((n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+inline static bool bitmap_test(const uint32_t* bitmap, size_t bit) {
+  return bitmap[bit / BITMAP_WORD_BITS] & (1u << (bit % BITMAP_WORD_BITS));
+}
+
+inline static void bitmap_set(uint32_t* bitmap, size_t bit) {
+  bitmap[bit / BITMAP_WORD_BITS] |= (1u << (bit % BITMAP_WORD_BITS));
+}
+
+inline static void bitmap_unset(uint32_t* bitmap, size_t bit) {
+  bitmap[bit / BITMAP_WORD_BITS] &= ~(1u << (bit % BITMAP_WORD_BITS));
+}
+
+// Sets or unsets count bits starting at first_bit, whole words at a time
+void bitmap_set_range(uint32_t* bitmap, size_t first_bit, size_t count);
+void bitmap_unset_range(uint32_t* bitmap, size_t first_bit, size_t count);
+
+// Returns true if none of the count bits starting at first_bit are set
+bool bitmap_is_range_unset(const uint32_t* bitmap,
+                           size_t first_bit,
+                           size_t count);
+
+// Returns the first set/unset bit in [from, num_bits), or num_bits if there
+// is none
+size_t bitmap_find_next_set(const uint32_t* bitmap,
+                            size_t num_bits,
+                            size_t from);
+size_t bitmap_find_next_unset(const uint32_t* bitmap,
+                              size_t num_bits,
+                              size_t from);
+
+// Returns the last set bit before the given bit, or -1 if there is none
+int32_t bitmap_find_prev_set(const uint32_t* bitmap, size_t before);
+
+// Returns the first bit of the first run of count unset bits in
+// [from, num_bits), or -1 if there is none
+int32_t bitmap_find_unset_run(const uint32_t* bitmap,
+                              size_t num_bits,
+                              size_t from,
+                              size_t count);
+
+#endif  // _LIBK_BITMAP_H_
@@ -1,6 +1,7 @@
 #ifndef _LIBK_HEAP_
 #define _LIBK_HEAP_
 
+#include <libk/bitmap.h>
 #include <libk/memlayout.h>
 #include <libk/virt_mem.h>
 #include <stdbool.h>
@@ -8,38 +9,168 @@
 #include <stdint.h>
 
 #define MALLOCED_CHECKSUM 0x12345678
+#define REDZONE_CHECKSUM 0x87654321
 
 #define HEAP_PAGE_ACTUAL_SIZE sizeof(heap_page_t)
 
+// Every page owned by the heap starts with a checksum followed by its kind,
+// so kfree can tell which allocator a pointer came from.
+typedef enum heap_page_kind_t {
+  // A heap_page_t, blocks handed out through its bitmaps
+  HEAP_PAGE_BLOCKS = 0,
+  // A heap_slab_t, fixed size objects of a single size class
+  HEAP_PAGE_SLAB = 1,
+  // A heap_span_t, a single large allocation over contiguous pages
+  HEAP_PAGE_SPAN = 2,
+} heap_page_kind_t;
+
 typedef struct heap_page_t {
   // If equal to 0x12345678, this is an actual alloced heap page
   size_t checksum;
+  // Always HEAP_PAGE_BLOCKS for a heap_page_t
+  uint32_t kind;
   // Number of available heap blocks. This doesn't guarantee that
   // this number of blocks are available in sequence.
   size_t num_available_blocks;
+  // Length and first block of the largest sequence of free blocks. Kept up
+  // to date on every alloc and free, so pages that can't fit a request are
+  // skipped without looking at their bitmaps.
+  uint16_t largest_free_run;
+  uint16_t largest_free_run_start;
   // bitmap: 1 represents an alloc block, 0 a free block
-  unsigned char alloced_block_bitmap[HEAP_BLOCK_BIT_MAP_SIZE];
+  uint32_t alloced_block_bitmap[HEAP_BLOCK_BIT_MAP_SIZE];
   // bitmap: 1 represents the starting block of an allocation, else 0
-  unsigned char first_alloced_bitmap[HEAP_BLOCK_BIT_MAP_SIZE];
+  uint32_t first_alloced_bitmap[HEAP_BLOCK_BIT_MAP_SIZE];
   // Actual memory being referenced by the bitmaps
   unsigned char alloc_memory[HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE];
-  // Next heap page in the heap page list
+  // Neighbours in the heap page list
   struct heap_page_t* next;
+  struct heap_page_t* prev;
 } heap_page_t;
 
 typedef struct heap_page_list_t {
   heap_page_t* head;
 } heap_page_list_t;
 
+// A slab holds objects of a single size class. Free objects are chained
+// through their first word, so taking or returning one is O(1).
+typedef struct heap_slab_t {
+  // If equal to 0x12345678, this is an actual alloced heap page
+  size_t checksum;
+  // Always HEAP_PAGE_SLAB for a heap_slab_t
+  uint32_t kind;
+  // Index of the size class this slab serves and its object size in bytes
+  uint32_t size_class;
+  uint32_t object_size;
+  // Number of objects in this slab not currently allocated
+  uint32_t num_free;
+  // Singly linked list of free objects, threaded through the objects
+  void* free_list;
+  // Neighbours in the list of slabs of this size class with free objects
+  struct heap_slab_t* prev;
+  struct heap_slab_t* next;
+  // bitmap: 1 represents an alloced object, 0 a free one
+  uint32_t alloced_object_bitmap[HEAP_SLAB_BIT_MAP_SIZE];
+  // Actual memory being split into objects
+  unsigned char alloc_memory[HEAP_SLAB_MEMORY_SIZE];
+} heap_slab_t;
+
+typedef struct heap_slab_list_t {
+  heap_slab_t* head;
+} heap_slab_list_t;
+
+// A span backs a single allocation too large for a heap page with as many
+// contiguous virtual pages as needed. The descriptor lives at the start of
+// the first page, so kfree finds it the same way as for any heap page.
+typedef struct heap_span_t {
+  // If equal to 0x12345678, this is an actual alloced heap page
+  size_t checksum;
+  // Always HEAP_PAGE_SPAN for a heap_span_t
+  uint32_t kind;
+  // Number of pages backing this span, including the one holding this header
+  uint32_t num_pages;
+  // Number of bytes requested for this allocation
+  uint32_t size;
+  // Actual memory handed out, running until the end of the last page
+  unsigned char alloc_memory[];
+} heap_span_t;
+
+// Front redzone of an allocation in HEAP_DEBUG builds, right before the
+// memory handed out. The back redzone right after the memory is filled
+// with HEAP_REDZONE_BYTE, up to HEAP_REDZONE_SIZE bytes past it or up to
+// the guard page if the allocation has one.
+typedef struct heap_redzone_t {
+  // Bytes asked for and the caller of kmalloc, kcalloc or krealloc
+  size_t size;
+  void* site;
+  // Pages before the guard page, 0 for allocations without one. Those
+  // start at the first of their pages, right after this redzone.
+  uint32_t guard_pages;
+  // REDZONE_CHECKSUM while allocated
+  uint32_t checksum;
+} heap_redzone_t;
+
 heap_page_list_t heap_page_list_;
-virtual_addr cur_heap_addr_;
+
+// Heap counters, always kept up to date so they can be read at any time
+typedef struct heap_stats_t {
+  // Allocations served by each slab size class, heap pages and spans
+  unsigned long size_class_allocs[HEAP_SLAB_CLASS_COUNT];
+  unsigned long heap_page_allocs;
+  unsigned long span_allocs;
+  unsigned long frees;
+  // Bytes handed out to callers, rounded up to their block or object size
+  // (spans count the requested size)
+  size_t bytes_in_use;
+  // Bytes of kernel virtual memory owned by the heap, headers included
+  size_t bytes_mapped;
+  size_t heap_pages;
+  size_t slabs;
+  size_t spans;
+  // Largest allocation a heap page can still serve without growing, in bytes
+  size_t largest_free_run;
+  // Percentage of the free bytes in heap pages outside of the largest free
+  // run of each page, 0 when the free memory is all in single runs
+  uint32_t fragmentation;
+  // Bucket i counts kmalloc calls that took [2^i, 2^(i+1)) TSC cycles, the
+  // last one also counts slower calls
+  unsigned long latency_histogram[HEAP_LATENCY_BUCKET_COUNT];
+} heap_stats_t;
 
 void* kmalloc(size_t size);
 void* kcalloc(size_t size);
 void kfree(void* ptr);
 
+// Resizes the allocation at ptr to size bytes, keeping its contents up to
+// the smaller of both sizes. Grows in place when the memory right after
+// the allocation is free and only moves it otherwise. Returns NULL and
+// leaves ptr untouched if the memory can't be found.
+void* krealloc(void* ptr, size_t size);
+
 void kernel_heap_init();
+
+// Gives every empty heap page and slab back to the PMM and vmem, including
+// the ones kept around for later allocations. Returns the number of pages
+// given back.
+size_t heap_trim();
+
+// Prints the allocation protected by a guard page, owner being the first
+// page of the allocation. Called by the page fault handler.
+void heap_report_guard_fault(virtual_addr owner);
+
+// Copies the heap counters into stats and computes the ones that need a
+// walk of the heap pages
+void get_heap_stats(heap_stats_t* stats);
+void print_heap_stats();
+
 heap_page_t* get_heap_block_metadata(void* ptr);
+heap_slab_t* get_heap_slab_metadata(void* ptr);
+heap_span_t* get_heap_span_metadata(void* ptr);
+
+// Returns the index of the smallest size class that fits bytes, or -1 if
+// bytes must be served by heap pages instead
+int32_t get_size_class(size_t bytes);
+size_t get_size_class_size(uint32_t size_class);
 
 // These are functions use to compute memory leaks.
 // TODO(psamora) Figure out a nice way to restructure this
@@ -65,8 +196,11 @@ void increase_memory_tracker(size_t bytes);
 
 void decrease_memory_tracker(size_t bytes);
 
+void resize_memory_tracker(size_t old_bytes, size_t new_bytes);
+
 // Helper used for tests for the Heap that force the heap to have an
-// empty Heap Page as the default one used
+// empty Heap Page as the default one used. Trims the heap first, so only
+// that page is empty.
 void force_empty_heap_page();
 
 #endif  // _LIBK_HEAP_
\ No newline at end of file
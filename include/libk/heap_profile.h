@@ -0,0 +1,48 @@
+#ifndef _LIBK_HEAP_PROFILE_H_
+#define _LIBK_HEAP_PROFILE_H_
+
+#include <libk/memlayout.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocation site profiler for the kernel heap, built in with
+// HEAP_PROFILE_SITES. Every live allocation is recorded with its size and
+// the return address of the kmalloc, kcalloc or krealloc call that made
+// it, in a fixed size hash table keyed by the allocation address. The heap
+// can't allocate its own bookkeeping, so allocations past
+// HEAP_PROFILE_MAX_LIVE are only counted as dropped.
+//
+// Allocations are also stamped with the epoch they were made in. Each
+// track_memory_malloced() starts a new epoch, so a leak report can name the
+// sites of the bytes leaked since then.
+
+// Live allocations of a site
+typedef struct heap_profile_site_t {
+  void* site;
+  size_t bytes;
+  size_t count;
+} heap_profile_site_t;
+
+// Records ptr as a live allocation of bytes made by site. Recording an
+// address again moves it to the new site and size, which is how krealloc
+// keeps its allocations.
+void heap_profile_alloc(void* ptr, size_t bytes, void* site);
+
+void heap_profile_free(void* ptr);
+
+uint32_t heap_profile_epoch();
+void heap_profile_next_epoch();
+
+// Fills sites with up to max sites of the allocations made since the given
+// epoch, the ones with most bytes (or allocations if by_count) first.
+// Returns the number of sites filled, always 0 without HEAP_PROFILE_SITES.
+size_t heap_profile_top_sites(heap_profile_site_t* sites,
+                              size_t max,
+                              bool by_count,
+                              uint32_t since_epoch);
+
+// Prints the top n sites by bytes and by count since the given epoch
+void heap_profile_dump(size_t n, uint32_t since_epoch);
+
+#endif  // _LIBK_HEAP_PROFILE_H_
@@ -18,22 +18,93 @@
 // Constants to the Physical Memory Manager
 #define PHYS_BLOCKS_PER_BYTE 8
 #define PHYS_BLOCK_SIZE 4096
+#define PHYS_BUDDY_MAX_ORDER 10  // largest buddy block is 2^10 blocks (4MB)
+#define PHYS_BUDDY_ORDER_COUNT (PHYS_BUDDY_MAX_ORDER + 1)
+// Memory the boot page directory identity maps, see boot.S. The PMM maps
+// are written through it before paging is set up, so they must end below
+// it, leaving room for the blocks virt_memory_init takes before paging.
+#define BOOT_IDENTITY_MAP_END 0x1000000
+#define BOOT_EARLY_ALLOC_SIZE 0x100000
 
 // Constants to the Virtual Memory Manager
-#define TEMPORARY_TABLE_ADDR (void*)0xC03FF000
+#define KERNEL_VIRT_BASE 0xC0000000  // physical 0 in the kernel direct map
+#define KERNEL_LARGE_PAGES 1  // map the kernel direct map with 4MB pages
+#define KERNEL_GLOBAL_PAGES 1  // global kernel mappings, if the CPU has PGE
+#define LARGE_PAGE_SIZE 0x400000
+#define PAGE_DIRECTORY_SELF_INDEX 1023  // directory entry mapping itself
+#define PAGE_TABLES_VIRT_ADDR 0xFFC00000  // every page table, through it
+#define PAGE_DIRECTORY_VIRT_ADDR 0xFFFFF000  // the page directory, through it
+#define FOREIGN_DIRECTORY_INDEX 1022  // entry mapping a directory being edited
+#define FOREIGN_TABLES_VIRT_ADDR 0xFF800000
+#define FOREIGN_DIRECTORY_VIRT_ADDR 0xFFFFE000
+#define KERNEL_DIRECTORY_INDEX 1021  // entry mapping the kernel directory
+#define KERNEL_TABLES_VIRT_ADDR 0xFF400000
+#define KERNEL_DIRECTORY_VIRT_ADDR 0xFFFFD000
+#define SCRATCH_VIRT_ADDR 0xFF3FF000  // maps a block while copying it
+#define ZERO_POOL_SIZE 64  // blocks zeroed ahead of time when idle
+#define USER_VIRT_ADDR_START 0x400000  // the first 4MB stay identity mapped
+#define USER_VIRT_ADDR_END KERNEL_VIRT_BASE
 #define PAGES_PER_TABLE 1024
 #define PAGES_PER_DIR 1024
 #define PAGE_SIZE 4096
 
+// Constants to the kernel virtual address allocator, which hands out the
+// kernel half from the end of the direct map up to VMEM_VIRT_ADDR_END
+#define KERNEL_DIRECT_MAP_END                                    \
+  (KERNEL_VIRT_BASE                                              \
+   + ((KERNEL_PHYS_MAP_END + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1)))
+#define VMEM_VIRT_ADDR_END SCRATCH_VIRT_ADDR
+#define VMEM_MAX_PAGES ((VMEM_VIRT_ADDR_END - KERNEL_VIRT_BASE) / PAGE_SIZE)
+
 // Constants to the Kernel heap
-#define HEAP_VIRT_ADDR_START 0xC0500000  // if kernel size > 4MB, change
+#ifndef HEAP_DEMAND_PAGING
+#define HEAP_DEMAND_PAGING 1  // back heap pages on first touch
+#endif
 #define HEAP_INITIAL_BLOCK_SIZE 128
+#define HEAP_MAX_EMPTY_PAGES 4  // empty pages kept before giving them back
+#define HEAP_LATENCY_BUCKET_COUNT 20  // log2 buckets of kmalloc TSC cycles
 
 #define HEAP_BLOCK_SIZE 16          // bytes
-#define HEAP_BLOCK_BIT_MAP_SIZE 31  // 31 bytes can represent 248 blocks
+#define HEAP_BLOCK_BIT_MAP_SIZE 8   // 8 words can represent 256 blocks
 #define HEAP_BLOCK_COUNT 248  // amount of blocks we can fit beside the bitmap
 #define HEAP_BLOCKS_NEED_FOR_N_BYTES(n)   \
-	(n / HEAP_BLOCK_SIZE) + (n % HEAP_BLOCK_SIZE == 0 ? 0 : 1)
+	(((n) / HEAP_BLOCK_SIZE) + ((n) % HEAP_BLOCK_SIZE == 0 ? 0 : 1))
+
+// Constants to the Kernel heap size classes (slabs)
+// Past 512 bytes so few objects fit beside the slab header that a lot of
+// the page is wasted, heap pages pack those sizes tighter
+#define HEAP_SLAB_CLASS_COUNT 10
+#define HEAP_SLAB_MAX_SIZE 512        // bytes, larger allocs use heap pages
+#define HEAP_SLAB_HEADER_SIZE 64      // bytes, keeps objects 16 byte aligned
+#define HEAP_SLAB_MEMORY_SIZE (PAGE_SIZE - HEAP_SLAB_HEADER_SIZE)
+#define HEAP_SLAB_BIT_MAP_SIZE 8      // 8 words can represent 256 objects
+
+// Constants to the Kernel heap spans (allocations larger than a heap page)
+#define HEAP_SPAN_HEADER_SIZE 16      // bytes, keeps memory 16 byte aligned
+#define HEAP_SPAN_PAGES_NEED_FOR_N_BYTES(n)                             \
+	(((n) + HEAP_SPAN_HEADER_SIZE) / PAGE_SIZE                            \
+	 + (((n) + HEAP_SPAN_HEADER_SIZE) % PAGE_SIZE == 0 ? 0 : 1))
+
+// Constants to the debug heap. With HEAP_DEBUG every allocation sits
+// between two redzones, checked when it is freed, and with
+// HEAP_DEBUG_GUARD_PAGES the ones larger than a slab object get pages of
+// their own followed by an unmapped guard page.
+#ifndef HEAP_DEBUG
+#define HEAP_DEBUG 0
+#endif
+#ifndef HEAP_DEBUG_GUARD_PAGES
+#define HEAP_DEBUG_GUARD_PAGES 1
+#endif
+#define HEAP_REDZONE_SIZE 16    // bytes, keeps memory 16 byte aligned
+#define HEAP_REDZONE_BYTE 0xFD  // fills the back redzone
+
+// Constants to the allocation site profiler, see libk/heap_profile.h
+#ifndef HEAP_PROFILE_SITES
+#define HEAP_PROFILE_SITES 0  // record the caller of every live allocation
+#endif
+#define HEAP_PROFILE_MAX_LIVE 4096   // live allocations, a power of two
+#define HEAP_PROFILE_MAX_SITES 256   // sites aggregated by a dump
+#define HEAP_PROFILE_REPORT_SITES 5  // sites printed by a leak report
 
 // Functions to
 #define ALIGN_BLOCK(addr) (addr) - ((addr) % PHYS_BLOCK_SIZE);
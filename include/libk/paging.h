@@ -20,6 +20,8 @@ enum PAGE_PTE_FLAGS {
   I86_PTE_PAT = 0x80,
   I86_PTE_CPU_GLOBAL = 0x100,
   I86_PTE_LV4_GLOBAL = 0x200,
+  I86_PTE_COPY_ON_WRITE = 0x400,  // available to the OS, see is_cow below
+  I86_PTE_GUARD = 0x800,          // available to the OS, see is_guard below
   I86_PTE_FRAME = 0x7FFFF000
 };
 
@@ -35,6 +37,12 @@ inline void pt_entry_set_frame(pt_entry* entry, physical_addr addr) {
   *entry = (*entry & ~I86_PTE_FRAME) | addr;
 }
 
+// Global entries stay in the TLB when CR3 is reloaded, so they are only
+// for mappings shared by every address space
+inline void pt_entry_enable_global(pt_entry* entry) {
+  *entry |= I86_PTE_CPU_GLOBAL;
+}
+
 inline bool pt_entry_is_present(pt_entry entry) {
   return entry & I86_PTE_PRESENT;
 }
@@ -43,6 +51,31 @@ inline bool pt_entry_is_writable(pt_entry entry) {
   return entry & I86_PTE_WRITABLE;
 }
 
+// Copy on write entries are read only and share their block. The first
+// write faults and gets a copy of the block of its own.
+inline void pt_entry_enable_cow(pt_entry* entry) {
+  *entry = (*entry & ~I86_PTE_WRITABLE) | I86_PTE_COPY_ON_WRITE;
+}
+
+inline bool pt_entry_is_cow(pt_entry entry) {
+  return entry & I86_PTE_COPY_ON_WRITE;
+}
+
+// Guard entries are never present, faulting on them is always a bug. The
+// rest of the entry holds the page aligned address of whatever the guard
+// protects, so the page fault handler can report it.
+inline void pt_entry_set_guard(pt_entry* entry, virtual_addr owner) {
+  *entry = (owner & ~(PAGE_SIZE - 1)) | I86_PTE_GUARD;
+}
+
+inline bool pt_entry_is_guard(pt_entry entry) {
+  return !(entry & I86_PTE_PRESENT) && (entry & I86_PTE_GUARD);
+}
+
+inline virtual_addr pt_entry_guard_owner(pt_entry entry) {
+  return entry & ~(PAGE_SIZE - 1);
+}
+
 inline physical_addr pt_entry_frame(pt_entry entry) {
   return entry & I86_PTE_FRAME;
 }
@@ -93,8 +126,10 @@ inline physical_addr pd_entry_frame(pd_entry entry) {
   return entry & I86_PDE_FRAME;
 }
 
-inline void pd_entry_enable_global(pd_entry entry) {
-  // TODO(psamora) Figure this out
+// Only has an effect on 4MB entries, the ones pointing at a page table get
+// it from their page table entries
+inline void pd_entry_enable_global(pd_entry* entry) {
+  *entry |= I86_PDE_CPU_GLOBAL;
 }
 
 #endif  // _LIBK_KPAGING_H_
\ No newline at end of file
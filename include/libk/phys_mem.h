@@ -5,8 +5,22 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// Flags of a page_t
+#define PAGE_RESERVED 0x1  // Firmware, kernel or PMM memory, never allocated
+
+// Descriptor of a physical block, see block_to_page
+typedef struct page_t {
+  // Number of owners of the block. Dropping the last one frees it.
+  uint16_t refcount;
+  // Number of page table entries mapping the block
+  uint16_t mapcount;
+  // PAGE_* flags
+  uint32_t flags;
+} page_t;
+
 // Physical memory manager
-// Currently implemented using bit map based allocation
+// Currently implemented using bit map based allocation, with a buddy
+// allocator on top of it to hand out aligned power of two runs of blocks.
 static uint32_t* phys_memory_map_ = 0;
 static uint32_t phys_mem_size_kb_ = 0;
 static uint32_t used_blocks_ = 0;
@@ -19,12 +33,31 @@ void phys_memory_init(struct multiboot_info* mb);
 
 void update_map_addr(physical_addr);
 
+// Allocates the lowest free block
 physical_addr alloc_block();
+
+// Allocates the lowest run of count contiguous blocks
 physical_addr alloc_blocks(uint32_t count);
 
+// Allocates 2^order contiguous blocks aligned to their size from the buddy
+// allocator, in O(PHYS_BUDDY_MAX_ORDER). Returns 0 if no such run is free.
+physical_addr alloc_blocks_order(uint32_t order);
+
 void free_block(physical_addr);
+
+// Frees count blocks, merging them with their free buddies. Works for
+// blocks from any of the alloc functions.
 void free_blocks(physical_addr, uint32_t count);
 
 bool is_alloced(physical_addr);
 
-#endif  // _LIBK_KPHYS_MEM_H_
\ No newline at end of file
+// Returns the descriptor of the block holding addr, or NULL if addr is past
+// the end of memory
+page_t* block_to_page(physical_addr addr);
+
+// Takes and drops a reference to an alloced block, so it can be shared by
+// several owners. The block is freed when its last reference is dropped.
+void get_block(physical_addr addr);
+void put_block(physical_addr addr);
+
+#endif  // _LIBK_KPHYS_MEM_H_
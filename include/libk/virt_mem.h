@@ -1,6 +1,7 @@
 #ifndef _LIBK_KVIRT_MEM_H_
 #define _LIBK_KVIRT_MEM_H_
 
+#include <arch/i386/interrupts.h>
 #include <asm.h>
 #include <libk/memlayout.h>
 #include <libk/paging.h>
@@ -12,6 +13,11 @@
 #define PAGE_GET_TABLE_ADDRESS(x) (*x & ~0xFFF)
 #define PAGE_GET_PHYSICAL_ADDRESS(x) (*x & ~0xFFF)
 
+// Page fault error code bits
+#define PAGE_FAULT_PROTECTION 0x1  // the page was present, access not allowed
+#define PAGE_FAULT_WRITE 0x2
+#define PAGE_FAULT_USER 0x4
+
 extern enable_paging(uint32_t page_dir);
 
 // Page Directory holds 1024 page directory entries
@@ -22,8 +28,17 @@ typedef struct page_directory {
 // Page Table holds 1024 page table entries
 typedef struct page_table { pt_entry m_entries[PAGES_PER_TABLE]; } page_table;
 
+// Physical address of the page directory loaded in CR3
 page_directory* cur_directory;
 
+// A page directory of its own. Every address space shares the kernel half
+// (and the identity mapped first 4MB) with the kernel address space, by
+// pointing at the same page tables, and has a private user half.
+typedef struct address_space {
+  // Physical address of the page directory, loaded in CR3 when current
+  physical_addr directory;
+} address_space;
+
 inline pt_entry* ptable_lookup_entry(page_table* table, virtual_addr addr) {
   if (table) return &table->m_entries[PAGE_TABLE_INDEX(addr)];
   return 0;
@@ -35,13 +50,105 @@ inline pd_entry* pdirectory_lookup_entry(page_directory* directory,
   return 0;
 }
 
+// The last entry of every page directory points back at the directory. The
+// MMU then walks it as a page table, so the current directory shows up at
+// PAGE_DIRECTORY_VIRT_ADDR and each of its page tables in the 4MB window
+// at PAGE_TABLES_VIRT_ADDR, one page per directory entry.
+
+inline page_directory* current_directory() {
+  return (page_directory*)PAGE_DIRECTORY_VIRT_ADDR;
+}
+
+// Only valid while the directory entry of addr is present
+inline page_table* current_table(virtual_addr addr) {
+  return (page_table*)(PAGE_TABLES_VIRT_ADDR
+                       + PAGE_DIRECTORY_INDEX(addr) * PAGE_SIZE);
+}
+
+// Every directory has an entry pointing at the kernel directory the same
+// way, which holds the reference copy of the kernel half. Kernel page tables
+// are created there and copied lazily into the other directories.
+inline page_directory* kernel_directory() {
+  return (page_directory*)KERNEL_DIRECTORY_VIRT_ADDR;
+}
+
 bool alloc_page(virtual_addr addr);
 void free_page(virtual_addr addr);
-void map_page(physical_addr, virtual_addr);
+bool map_page(physical_addr, virtual_addr);
 uint32_t virt_to_phys(virtual_addr addr);
 
+// Range versions of the above, for count pages starting at addr. They fill
+// every entry first and flush the TLB once at the end, and only if a
+// present mapping was changed: new mappings are never in the TLB.
+
+// Backs each page with a new block. On failure nothing stays mapped.
+bool alloc_range(virtual_addr addr, uint32_t count);
+// Maps count contiguous blocks starting at paddr, each mapping taking over
+// a reference of the caller. On failure nothing stays mapped and the caller
+// keeps its references.
+bool map_range(physical_addr paddr, virtual_addr addr, uint32_t count);
+// Same as map_range but uncached, for memory mapped device registers which
+// must see every access in order
+bool map_device_range(physical_addr paddr, virtual_addr addr, uint32_t count);
+// Unmaps every present page, dropping the references they held
+void unmap_range(virtual_addr addr, uint32_t count);
+
+// Unmaps addr and makes it a guard page, which is never backed: touching
+// it is reported as an access past owner. Unmapping it clears the guard.
+// Returns false if its page table can't be allocated.
+bool map_guard_page(virtual_addr addr, virtual_addr owner);
+bool is_guard_page(virtual_addr addr);
+
+// Addresses in [start, end) that vmem has handed out are backed lazily: the
+// first access to each of their pages faults. Reads map a shared zero page
+// copy on write, writes a zeroed block of their own. A single range is kept,
+// which a later call replaces: it is the vmem window, set up by vmem_init.
+void reserve_range(virtual_addr start, virtual_addr end);
+
+void page_fault_handler(struct regs* r);
+
+// Returns a new address space with the kernel half of the kernel address
+// space and nothing mapped in its user half, or NULL if out of memory. Only
+// allocates its page directory.
+address_space* create_address_space();
+
+// Unmaps the whole user half of space, dropping the references it held on
+// its blocks, and frees its page tables and directory. The space can't be
+// the current one.
+void destroy_address_space(address_space* space);
+
+// Loads the directory of space in CR3. Global kernel mappings stay in the
+// TLB, everything else is flushed.
+void switch_address_space(address_space* space);
+
+address_space* current_address_space();
+
+// Maps the count pages starting at addr in the current address space into
+// dest as well, sharing their blocks. Writable pages turn copy on write in
+// both, so whichever writes first gets its own copy from the page fault
+// handler. Only for the user half. Returns false if out of memory.
+bool copy_range_cow(address_space* dest, virtual_addr addr, uint32_t count);
+
+// Returns a block filled with zeroes, popped from the pool of blocks
+// zeroed while idle when it isn't empty. Returns 0 if out of memory.
+physical_addr alloc_zeroed_block();
+
+// Zeroes one more block into the pool, meant for the idle loop. The pool
+// isn't safe to share with interrupt handlers, so they must be off. Returns
+// false if the pool is full or out of memory, so the idle loop knows when to
+// halt.
+bool refill_zero_pool();
+
 void virt_memory_init();
 
+// Past this many pages, one full flush is cheaper than an invlpg per page
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
 inline void flush_tlb_entry(virtual_addr addr) { invlpg((void*)addr); }
 
+// Flushes every TLB entry, global ones included
+void flush_tlb_all();
+
+void flush_tlb_range(virtual_addr addr, uint32_t count);
+
 #endif  // _LIBK_KVIRT_MEM_H_
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef _LIBK_VMEM_H_
+#define _LIBK_VMEM_H_
+
+#include <libk/memlayout.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Kernel virtual address allocator. Hands out page aligned ranges of
+// [KERNEL_DIRECT_MAP_END, VMEM_VIRT_ADDR_END) to the heap, device memory
+// and anything else that needs addresses of its own, and takes them back
+// so they can be reused. Ranges are tracked by a bitmap with a bit per page,
+// set if the page is taken, searched first fit from the lowest free page.
+//
+// Ranges aren't backed by memory when handed out: the page fault handler
+// backs each page on its first touch, unless the owner maps it first.
+
+void vmem_init();
+
+// Returns the first address of count contiguous free pages, or 0 if there
+// is no such run
+virtual_addr vmem_alloc(uint32_t count);
+
+// Grows the range at addr from count to new_count pages, if the pages right
+// after it are free. Returns false otherwise.
+bool vmem_extend(virtual_addr addr, uint32_t count, uint32_t new_count);
+
+// Unmaps the count pages at addr, dropping the references they held on
+// their blocks, and gives back their addresses
+void vmem_free(virtual_addr addr, uint32_t count);
+
+// Maps the count blocks of device memory at paddr to a new range, uncached.
+// Returns 0 if there is no room. Give it back with vmem_free.
+virtual_addr vmem_map_device(physical_addr paddr, uint32_t count);
+
+// Returns true if the page holding addr was handed out
+bool vmem_is_alloced(virtual_addr addr);
+
+#endif  // _LIBK_VMEM_H_
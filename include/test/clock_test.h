@@ -0,0 +1,6 @@
+#ifndef _TEST_CLOCK_TEST_
+#define _TEST_CLOCK_TEST_
+
+void test_clock();
+
+#endif  // _TEST_CLOCK_TEST_
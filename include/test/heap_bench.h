@@ -0,0 +1,8 @@
+#ifndef _TEST_HEAP_BENCH_
+#define _TEST_HEAP_BENCH_
+
+// Prints the average TSC cycles of kmalloc and kfree under fixed size
+// churn, random size churn, producer/consumer frees and fragmentation
+void bench_heap();
+
+#endif  // _TEST_HEAP_BENCH_
@@ -0,0 +1,6 @@
+#ifndef _TEST_HEAP_DEBUG_TEST_
+#define _TEST_HEAP_DEBUG_TEST_
+
+void test_heap_debug();
+
+#endif  // _TEST_HEAP_DEBUG_TEST_
\ No newline at end of file
@@ -0,0 +1,6 @@
+#ifndef _TEST_HEAP_PROFILE_TEST_
+#define _TEST_HEAP_PROFILE_TEST_
+
+void test_heap_profile();
+
+#endif  // _TEST_HEAP_PROFILE_TEST_
\ No newline at end of file
@@ -0,0 +1,6 @@
+#ifndef _TEST_TIMER_TEST_
+#define _TEST_TIMER_TEST_
+
+void test_timer();
+
+#endif  // _TEST_TIMER_TEST_
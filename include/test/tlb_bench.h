@@ -0,0 +1,8 @@
+#ifndef _TEST_TLB_BENCH_
+#define _TEST_TLB_BENCH_
+
+// Prints the cost of a CR3 reload followed by touching kernel heap pages,
+// with and without global pages
+void bench_tlb();
+
+#endif  // _TEST_TLB_BENCH_
@@ -0,0 +1,6 @@
+#ifndef _TEST_VIRT_MEM_TEST_
+#define _TEST_VIRT_MEM_TEST_
+
+void test_virt_mem();
+
+#endif  // _TEST_VIRT_MEM_TEST_
@@ -0,0 +1,6 @@
+#ifndef _TEST_VMEM_TEST_
+#define _TEST_VMEM_TEST_
+
+void test_vmem();
+
+#endif  // _TEST_VMEM_TEST_
@@ -72,6 +72,10 @@ DECLARE_INTERRUPT_HANDLER(45);
 DECLARE_INTERRUPT_HANDLER(46);
 DECLARE_INTERRUPT_HANDLER(47);
 
+/* Local APIC */
+DECLARE_INTERRUPT_HANDLER(48);
+DECLARE_INTERRUPT_HANDLER(255);
+
 void set_idt_entry(uint8_t num, uint64_t handler, uint16_t sel, uint8_t flags) {
   idt[num].handler_lo = handler & 0xFFFF;
   idt[num].handler_hi = (handler >> 16) & 0xFFFF;
@@ -129,6 +133,10 @@ void idt_install() {
   SET_IDT_ENTRY(46);
   SET_IDT_ENTRY(47);
 
+  /* Local APIC */
+  SET_IDT_ENTRY(48);
+  SET_IDT_ENTRY(255);
+
   // Remap PICs. Maybe move this somewhere else in the future.
   outb(0x20, 0x10);
   outb(0xA0, 0x10);
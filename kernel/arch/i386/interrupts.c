@@ -23,6 +23,12 @@ bool register_interrupt_handler(
 }
 
 void fault_handler(struct regs *r) {
+  // Faults the kernel can recover from, like page faults, have a handler
+  if (interrupt_handlers[r->idt_index]) {
+    interrupt_handlers[r->idt_index](r);
+    return;
+  }
+
   printf("System Exception. System Halted!\n");
   for (;;);
 }
@@ -0,0 +1,139 @@
+#include <asm.h>
+#include <devices/clock.h>
+#include <devices/timer.h>
+#include <stdio.h>
+
+// PIT channel 2 is only wired to the speaker, so it can be used to time the
+// calibration without touching channel 0 and the timer interrupt
+#define PIT_CHANNEL2_PORT 0x42
+#define PIT_COMMAND_PORT 0x43
+#define PIT_CHANNEL2_ONE_SHOT 0xB0  // Channel 2, low then high byte, mode 0
+#define PIT_GATE_PORT 0x61
+#define PIT_GATE_CHANNEL2 0x01  // Lets channel 2 count
+#define PIT_GATE_SPEAKER 0x02   // Connects channel 2 to the speaker
+#define PIT_GATE_OUT2 0x20      // Output of channel 2, high once it expires
+
+#define CLOCK_CALIBRATION_MS 10
+#define CLOCK_CALIBRATION_RUNS 3
+// Polls of the channel 2 output before giving up on the PIT, far more than
+// CLOCK_CALIBRATION_MS worth of port reads
+#define CLOCK_CALIBRATION_MAX_POLLS 10000000
+
+// Nanoseconds per cycle are kept as a fixed point number with this many
+// fractional bits, so converting cycles takes two multiplications
+#define CLOCK_NS_SHIFT 24
+
+static bool clock_has_tsc_ = false;
+static uint32_t clock_tsc_khz_ = 0;
+static uint32_t clock_ns_per_cycle_ = 0;  // Fixed point, CLOCK_NS_SHIFT bits
+static uint64_t clock_tsc_base_ = 0;
+
+// Nanoseconds per cycle of a TSC at khz, in CLOCK_NS_SHIFT fixed point
+static uint32_t ns_per_cycle(uint32_t khz) {
+  return khz ? (uint32_t) ((1000000ull << CLOCK_NS_SHIFT) / khz) : 0;
+}
+
+static bool cpu_has_tsc() {
+  uint32_t regs[4];
+  cpuid(1, regs);
+  return regs[3] & CPUID_EDX_TSC;
+}
+
+// A TSC that isn't invariant may change its rate with the CPU frequency or
+// stop in deep sleep states
+static bool cpu_has_invariant_tsc() {
+  uint32_t regs[4];
+  cpuid(0x80000000, regs);
+  if (regs[0] < 0x80000007) {
+    return false;
+  }
+  cpuid(0x80000007, regs);
+  return regs[3] & CPUID_EDX_INVARIANT_TSC;
+}
+
+// Returns the TSC cycles it takes PIT channel 2 to count down
+// CLOCK_CALIBRATION_MS, or 0 if it never expired
+static uint64_t measure_tsc_cycles(uint32_t pit_count) {
+  uint8_t gate = inb(PIT_GATE_PORT);
+  outb(PIT_GATE_PORT, (gate & ~PIT_GATE_SPEAKER) | PIT_GATE_CHANNEL2);
+
+  // The count starts right after its high byte is written
+  outb(PIT_COMMAND_PORT, PIT_CHANNEL2_ONE_SHOT);
+  outb(PIT_CHANNEL2_PORT, pit_count & 0xFF);
+  outb(PIT_CHANNEL2_PORT, pit_count >> 8);
+  uint64_t start = rdtsc();
+  for (uint32_t polls = 0; polls < CLOCK_CALIBRATION_MAX_POLLS; polls++) {
+    if (inb(PIT_GATE_PORT) & PIT_GATE_OUT2) {
+      return rdtsc() - start;
+    }
+  }
+  return 0;
+}
+
+// Returns the TSC frequency in KHz, or 0 if the PIT didn't respond
+static uint32_t calibrate_tsc() {
+  uint32_t pit_count = PIT_FREQUENCY / 1000 * CLOCK_CALIBRATION_MS;
+
+  // Anything happening during a run, like an SMI, only makes it longer, so
+  // the shortest run is the closest to the real frequency
+  uint64_t cycles = 0;
+  for (uint32_t run = 0; run < CLOCK_CALIBRATION_RUNS; run++) {
+    uint64_t run_cycles = measure_tsc_cycles(pit_count);
+    if (!run_cycles) {
+      return 0;
+    }
+    if (!cycles || run_cycles < cycles) {
+      cycles = run_cycles;
+    }
+  }
+  return (uint32_t) (cycles * PIT_FREQUENCY / pit_count / 1000);
+}
+
+void clock_install() {
+  if (cpu_has_tsc()) {
+    clock_tsc_khz_ = calibrate_tsc();
+  }
+  if (clock_tsc_khz_ < CLOCK_MIN_TSC_KHZ) {
+    clock_tsc_khz_ = 0;
+    printf("Clock installed. No usable TSC, using the timer ticks\n");
+    return;
+  }
+
+  clock_ns_per_cycle_ = ns_per_cycle(clock_tsc_khz_);
+  clock_has_tsc_ = true;
+  clock_tsc_base_ = rdtsc();
+  printf("Clock installed. TSC at %u KHz%s\n", clock_tsc_khz_,
+         cpu_has_invariant_tsc() ? "" : ", not invariant");
+}
+
+uint64_t now_ns() {
+  if (!clock_has_tsc_) {
+    return (uint64_t) timer_get_ticks() * (NS_PER_SECOND / TICKS_PER_SECOND);
+  }
+  return cycles_to_ns(rdtsc() - clock_tsc_base_);
+}
+
+uint64_t now_cycles() {
+  return clock_has_tsc_ ? rdtsc() : 0;
+}
+
+uint64_t cycles_to_ns(uint64_t cycles) {
+  // Splits cycles in 32 bit halves so no product overflows 64 bits
+  uint32_t high = cycles >> 32;
+  uint32_t low = (uint32_t) cycles;
+  return (((uint64_t) low * clock_ns_per_cycle_) >> CLOCK_NS_SHIFT)
+         + (((uint64_t) high * clock_ns_per_cycle_) << (32 - CLOCK_NS_SHIFT));
+}
+
+bool clock_has_tsc() {
+  return clock_has_tsc_;
+}
+
+uint32_t clock_tsc_khz() {
+  return clock_tsc_khz_;
+}
+
+void force_clock_tsc_khz(uint32_t khz) {
+  clock_tsc_khz_ = khz;
+  clock_ns_per_cycle_ = ns_per_cycle(khz);
+}
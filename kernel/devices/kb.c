@@ -3,6 +3,7 @@
 #include <arch/i386/tty.h>
 #include <asm.h>
 #include <devices/kb.h>
+#include <libk/heap.h>
 #include <stdio.h>
 
 struct kb_state {
@@ -133,6 +134,9 @@ void keyboard_handler(__attribute__((unused)) struct regs *r) {
       case 58:  // caps lock
         state.caps_lock = !state.caps_lock;
         break;
+      case 59:  // F1 dumps the heap statistics
+        print_heap_stats();
+        break;
       default:
         column = state.shift_held * 1 + state.caps_lock * 2;
         clicked = kbdus[scancode][column];
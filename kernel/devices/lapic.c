@@ -0,0 +1,96 @@
+#include <arch/i386/interrupts.h>
+#include <asm.h>
+#include <devices/clock.h>
+#include <devices/lapic.h>
+#include <libk/vmem.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE 0x800
+#define IA32_APIC_BASE_FRAME 0xFFFFF000
+
+// Registers, as byte offsets into the local APIC page
+#define LAPIC_EOI 0xB0
+#define LAPIC_SPURIOUS 0xF0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SPURIOUS_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000  // Mode bits left at 0 mean one-shot
+#define LAPIC_DIVIDE_BY_16 0x3
+
+#define LAPIC_CALIBRATION_NS 10000000ull
+
+// Mapped uncached by vmem_map_device, so register accesses go straight to
+// the local APIC
+static volatile uint32_t* lapic_ = NULL;
+static uint32_t lapic_timer_khz_ = 0;
+
+inline static uint32_t lapic_read(uint32_t reg) {
+  return lapic_[reg / sizeof(uint32_t)];
+}
+
+inline static void lapic_write(uint32_t reg, uint32_t val) {
+  lapic_[reg / sizeof(uint32_t)] = val;
+}
+
+static bool cpu_has_lapic() {
+  uint32_t regs[4];
+  cpuid(1, regs);
+  return regs[3] & CPUID_EDX_APIC;
+}
+
+// Counts the timer ticks over LAPIC_CALIBRATION_NS of the TSC clock
+static uint32_t calibrate_timer() {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_BY_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_IDT_INDEX);
+  lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+  uint64_t end = now_ns() + LAPIC_CALIBRATION_NS;
+  while (now_ns() < end) {
+  }
+  uint32_t ticks = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+  return (uint32_t) (ticks * 1000000ull / LAPIC_CALIBRATION_NS);
+}
+
+bool lapic_install() {
+  if (!cpu_has_lapic() || !clock_has_tsc()) {
+    return false;
+  }
+
+  uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+  if (!(base & IA32_APIC_BASE_ENABLE)) {
+    wrmsr(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_ENABLE);
+  }
+  lapic_ = (uint32_t*) vmem_map_device(base & IA32_APIC_BASE_FRAME, 1);
+  if (!lapic_) {
+    printf("LOCAL APIC NOT MAPPED\n");
+    return false;
+  }
+
+  // Interrupts from the PIC keep coming through LINT0 as the firmware set
+  // it up, only the timer is taken over
+  lapic_write(LAPIC_SPURIOUS, LAPIC_SPURIOUS_ENABLE | LAPIC_SPURIOUS_IDT_INDEX);
+  lapic_timer_khz_ = calibrate_timer();
+  if (lapic_timer_khz_ == 0) {
+    return false;
+  }
+  printf("Local APIC installed. Timer at %u KHz\n", lapic_timer_khz_);
+  return true;
+}
+
+void lapic_eoi() {
+  lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_timer_one_shot(uint32_t count) {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_IDT_INDEX);
+  lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_khz() {
+  return lapic_timer_khz_;
+}
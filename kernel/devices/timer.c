@@ -1,29 +1,201 @@
 #include <arch/i386/idt.h>
 #include <arch/i386/interrupts.h>
 #include <asm.h>
+#include <devices/clock.h>
+#include <devices/lapic.h>
 #include <devices/timer.h>
+#include <stddef.h>
 #include <stdio.h>
 
-#define TICKS_PER_SECOND 100
+#define PIT_CHANNEL0_PORT 0x40
+#define PIT_COMMAND_PORT 0x43
+#define PIT_CHANNEL0_ONE_SHOT 0x30  // Channel 0, low then high byte, mode 0
+#define PIT_MAX_COUNT 0xFFFF
+#define PIC_MASTER_DATA_PORT 0x21
+#define PIC_IRQ0 0x01
+
+#define NS_PER_TICK (NS_PER_SECOND / TICKS_PER_SECOND)
+// Longest one-shot, so converting it to timer counts can't overflow. Later
+// deadlines take a few interrupts to reach.
+#define TIMER_MAX_ONE_SHOT_NS NS_PER_SECOND
+
+typedef enum timer_mode_t {
+  TIMER_PERIODIC,       // PIT interrupts TICKS_PER_SECOND times a second
+  TIMER_PIT_ONE_SHOT,   // PIT interrupts at the next deadline only
+  TIMER_LAPIC_ONE_SHOT  // Local APIC timer interrupts at the next deadline
+} timer_mode_t;
+
+static timer_mode_t timer_mode_ = TIMER_PERIODIC;
+
+// Pending events, soonest deadline first
+static timer_event_t* timer_queue_ = NULL;
 
 // Holds how many ticks that the system has been running for
-int timer_ticks = 0;
+volatile uint32_t timer_ticks = 0;
 
 void timer_phase(int hz) {
-  int divisor = 1193180 / hz;  // Calculates the divisor
-  outb(0x43, 0x36);            // Set our command byte 0x36
-  outb(0x40, divisor & 0xFF);  // Set low byte of divisor
-  outb(0x40, divisor >> 8);    // Set high byte of divisor
+  int divisor = PIT_FREQUENCY / hz;  // Calculates the divisor
+  outb(0x43, 0x36);                  // Set our command byte 0x36
+  outb(0x40, divisor & 0xFF);        // Set low byte of divisor
+  outb(0x40, divisor >> 8);          // Set high byte of divisor
 }
 
-// IRQ Handler for the timer. Called at every clock tick
+// Raises IRQ0 once, count PIT cycles from now. Once it fired the PIT stays
+// quiet until it is programmed again.
+static void pit_one_shot(uint32_t count) {
+  outb(PIT_COMMAND_PORT, PIT_CHANNEL0_ONE_SHOT);
+  outb(PIT_CHANNEL0_PORT, count & 0xFF);
+  outb(PIT_CHANNEL0_PORT, count >> 8);
+}
+
+// Arms the one-shot timer for the first event in the queue
+static void program_next_deadline() {
+  if (timer_mode_ == TIMER_PERIODIC) {
+    return;
+  }
+  if (!timer_queue_) {
+    if (timer_mode_ == TIMER_LAPIC_ONE_SHOT) {
+      lapic_timer_one_shot(0);
+    }
+    return;
+  }
+
+  uint64_t now = now_ns();
+  uint64_t delay = 0;
+  if (timer_queue_->deadline_ns > now) {
+    delay = timer_queue_->deadline_ns - now;
+  }
+  if (delay > TIMER_MAX_ONE_SHOT_NS) {
+    delay = TIMER_MAX_ONE_SHOT_NS;
+  }
+
+  // Deadlines already due still need an interrupt, so counts are at least 1
+  if (timer_mode_ == TIMER_LAPIC_ONE_SHOT) {
+    uint32_t count = delay * lapic_timer_khz() / 1000000;
+    lapic_timer_one_shot(count ? count : 1);
+  } else {
+    uint32_t count = delay * PIT_FREQUENCY / NS_PER_SECOND;
+    if (count > PIT_MAX_COUNT) {
+      count = PIT_MAX_COUNT;
+    }
+    pit_one_shot(count ? count : 1);
+  }
+}
+
+// Takes every event that is due off the queue and runs it. Runs with
+// interrupts off.
+static void run_expired_events() {
+  uint64_t now = now_ns();
+  while (timer_queue_ && timer_queue_->deadline_ns <= now) {
+    timer_event_t* event = timer_queue_;
+    timer_queue_ = event->next;
+    event->next = NULL;
+    event->callback(event->data);
+  }
+}
+
+// IRQ Handler for the timer. Called at every clock tick, or at the next
+// deadline when tickless
 void timer_handler(struct regs *r) {
-  timer_ticks++;
+  (void) r;
+  if (timer_mode_ == TIMER_PERIODIC) {
+    timer_ticks++;
+  }
+  run_expired_events();
+  program_next_deadline();
+}
+
+#if TIMER_TICKLESS
+static void lapic_timer_handler(struct regs* r) {
+  (void) r;
+  run_expired_events();
+  program_next_deadline();
+  lapic_eoi();
+}
+#endif
+
+uint32_t timer_get_ticks() {
+  if (timer_mode_ == TIMER_PERIODIC) {
+    return timer_ticks;
+  }
+  // Tickless modes are only used with the TSC clock
+  return (uint32_t) (now_ns() / NS_PER_TICK);
+}
+
+// Unlinks event from the queue if it is in it. Interrupts must be off.
+static bool unlink_event(timer_event_t* event) {
+  for (timer_event_t** link = &timer_queue_; *link; link = &(*link)->next) {
+    if (*link == event) {
+      *link = event->next;
+      event->next = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+void timer_add(timer_event_t* event,
+               uint64_t deadline_ns,
+               timer_callback_t callback,
+               void* data) {
+  uint32_t eflags = save_interrupts();
+  unlink_event(event);
+  event->deadline_ns = deadline_ns;
+  event->callback = callback;
+  event->data = data;
+
+  // Events with the same deadline run in the order they were added
+  timer_event_t** link = &timer_queue_;
+  while (*link && (*link)->deadline_ns <= deadline_ns) {
+    link = &(*link)->next;
+  }
+  event->next = *link;
+  *link = event;
+
+  if (timer_queue_ == event) {
+    program_next_deadline();
+  }
+  restore_interrupts(eflags);
+}
+
+bool timer_cancel(timer_event_t* event) {
+  uint32_t eflags = save_interrupts();
+  bool was_pending = unlink_event(event);
+  // An interrupt armed for the event finds nothing to run and rearms
+  restore_interrupts(eflags);
+  return was_pending;
+}
+
+timer_event_t* timer_first_event() {
+  return timer_queue_;
 }
 
 // Sets up the system clock
 void timer_install() {
   register_interrupt_handler(TIMER_IDT_INDEX, timer_handler);
+
+#if TIMER_TICKLESS
+  // The deadlines are kept in nanoseconds of the TSC clock, without it the
+  // timer keeps ticking
+  if (clock_has_tsc()) {
+    if (lapic_install()) {
+      register_interrupt_handler(LAPIC_TIMER_IDT_INDEX, lapic_timer_handler);
+      // The PIT is still ticking at the rate the BIOS left it at
+      outb(PIC_MASTER_DATA_PORT, inb(PIC_MASTER_DATA_PORT) | PIC_IRQ0);
+      timer_mode_ = TIMER_LAPIC_ONE_SHOT;
+      printf("Timer installed. Tickless, local APIC one-shot\n");
+    } else {
+      // Stops the periodic ticks of the BIOS, with a last one nobody waits
+      // for
+      pit_one_shot(PIT_MAX_COUNT);
+      timer_mode_ = TIMER_PIT_ONE_SHOT;
+      printf("Timer installed. Tickless, PIT one-shot\n");
+    }
+    program_next_deadline();
+    return;
+  }
+#endif
+
   timer_phase(TICKS_PER_SECOND);
   printf("Timer installed.\n");
-}
\ No newline at end of file
+}
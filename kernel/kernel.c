@@ -7,31 +7,51 @@
 #include <arch/i386/idt.h>
 #include <arch/i386/tty.h>
 #include <asm.h>
+#include <devices/clock.h>
 #include <devices/kb.h>
 #include <devices/timer.h>
 #include <external/multiboot.h>
 #include <libk/heap.h>
 #include <libk/phys_mem.h>
 #include <libk/virt_mem.h>
+#include <libk/vmem.h>
+#include <test/clock_test.h>
 #include <test/hashmap_test.h>
+#include <test/heap_bench.h>
+#include <test/heap_debug_test.h>
+#include <test/heap_profile_test.h>
 #include <test/heap_test.h>
 #include <test/macros_test.h>
 #include <test/phys_mem_test.h>
+#include <test/timer_test.h>
+#include <test/tlb_bench.h>
 #include <test/vector_test.h>
+#include <test/virt_mem_test.h>
+#include <test/vmem_test.h>
 
 void kernel_early(struct multiboot_info* mb) {
   terminal_initialize();
   gdt_install();
   idt_install();
+  clock_install();
 
   phys_memory_init(mb);
   virt_memory_init();
+  vmem_init();
   kernel_heap_init();
   test_macros();
   test_phys_mem();
+  test_virt_mem();
+  test_vmem();
   test_heap();
+  test_heap_profile();
+  test_heap_debug();
   test_vector();
   test_hashmap();
+  test_clock();
+  test_timer();
+  bench_tlb();
+  bench_heap();
 
   timer_install();
   keyboard_install();
@@ -43,6 +63,12 @@ void kernel_main(void) {
   // int a = 10;
   // printf("aia %lx\n", virt_to_phys((virtual_addr)&a));
   for (;;) {
-    asm("hlt");
+    // Zero blocks ahead of time while there is nothing else to do
+    disable_interrupts();
+    bool refilled = refill_zero_pool();
+    enable_interrupts();
+    if (!refilled) {
+      asm("hlt");
+    }
   }
 }
@@ -0,0 +1,126 @@
+#include <libk/bitmap.h>
+
+// Mask with the bits [first, first + count) of a word set, count <= 32
+inline static uint32_t word_mask(size_t first, size_t count) {
+  if (count == BITMAP_WORD_BITS) {
+    return BITMAP_FULL_WORD;
+  }
+  return ((1u << count) - 1) << first;
+}
+
+void bitmap_set_range(uint32_t* bitmap, size_t first_bit, size_t count) {
+  while (count > 0) {
+    size_t offset = first_bit % BITMAP_WORD_BITS;
+    size_t bits = BITMAP_WORD_BITS - offset;
+    if (bits > count) {
+      bits = count;
+    }
+    bitmap[first_bit / BITMAP_WORD_BITS] |= word_mask(offset, bits);
+    first_bit += bits;
+    count -= bits;
+  }
+}
+
+void bitmap_unset_range(uint32_t* bitmap, size_t first_bit, size_t count) {
+  while (count > 0) {
+    size_t offset = first_bit % BITMAP_WORD_BITS;
+    size_t bits = BITMAP_WORD_BITS - offset;
+    if (bits > count) {
+      bits = count;
+    }
+    bitmap[first_bit / BITMAP_WORD_BITS] &= ~word_mask(offset, bits);
+    first_bit += bits;
+    count -= bits;
+  }
+}
+
+bool bitmap_is_range_unset(const uint32_t* bitmap,
+                           size_t first_bit,
+                           size_t count) {
+  return bitmap_find_next_set(bitmap, first_bit + count, first_bit)
+         == first_bit + count;
+}
+
+size_t bitmap_find_next_set(const uint32_t* bitmap,
+                            size_t num_bits,
+                            size_t from) {
+  if (from >= num_bits) {
+    return num_bits;
+  }
+
+  // Ignore the bits before from in its word
+  size_t word = from / BITMAP_WORD_BITS;
+  uint32_t bits = bitmap[word] & ~word_mask(0, from % BITMAP_WORD_BITS);
+  size_t last_word = (num_bits - 1) / BITMAP_WORD_BITS;
+  while (bits == 0) {
+    if (++word > last_word) {
+      return num_bits;
+    }
+    bits = bitmap[word];
+  }
+
+  size_t bit = word * BITMAP_WORD_BITS + __builtin_ctz(bits);
+  return bit < num_bits ? bit : num_bits;
+}
+
+size_t bitmap_find_next_unset(const uint32_t* bitmap,
+                              size_t num_bits,
+                              size_t from) {
+  if (from >= num_bits) {
+    return num_bits;
+  }
+
+  // Same as bitmap_find_next_set, looking at the inverted words
+  size_t word = from / BITMAP_WORD_BITS;
+  uint32_t bits = ~bitmap[word] & ~word_mask(0, from % BITMAP_WORD_BITS);
+  size_t last_word = (num_bits - 1) / BITMAP_WORD_BITS;
+  while (bits == 0) {
+    if (++word > last_word) {
+      return num_bits;
+    }
+    bits = ~bitmap[word];
+  }
+
+  size_t bit = word * BITMAP_WORD_BITS + __builtin_ctz(bits);
+  return bit < num_bits ? bit : num_bits;
+}
+
+int32_t bitmap_find_prev_set(const uint32_t* bitmap, size_t before) {
+  if (before == 0) {
+    return -1;
+  }
+
+  // Ignore the bits from before onwards in its word
+  size_t last = before - 1;
+  size_t word = last / BITMAP_WORD_BITS;
+  uint32_t bits = bitmap[word] & word_mask(0, last % BITMAP_WORD_BITS + 1);
+  while (bits == 0) {
+    if (word-- == 0) {
+      return -1;
+    }
+    bits = bitmap[word];
+  }
+
+  return word * BITMAP_WORD_BITS + (BITMAP_WORD_BITS - 1 - __builtin_clz(bits));
+}
+
+int32_t bitmap_find_unset_run(const uint32_t* bitmap,
+                              size_t num_bits,
+                              size_t from,
+                              size_t count) {
+  if (count == 0) {
+    return -1;
+  }
+
+  // Jump from the start of each unset run to the set bit that ends it
+  size_t run_start = bitmap_find_next_unset(bitmap, num_bits, from);
+  while (run_start + count <= num_bits) {
+    size_t run_end = bitmap_find_next_set(bitmap, run_start + count,
+                                          run_start);
+    if (run_end == run_start + count) {
+      return run_start;
+    }
+    run_start = bitmap_find_next_unset(bitmap, num_bits, run_end);
+  }
+  return -1;
+}
@@ -1,10 +1,31 @@
+#include <asm.h>
 #include <libk/heap.h>
+#include <libk/heap_profile.h>
+#include <libk/vmem.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
-void request_memory();
+void* heap_alloc(size_t bytes);
+void* heap_realloc(void* ptr, size_t bytes);
+void heap_free(void* ptr);
+bool request_memory();
+void release_heap_page(heap_page_t* heap_page);
+heap_slab_t* request_slab(uint32_t size_class);
+void release_slab(heap_slab_t* slab);
 void initialize_heap_page(heap_page_t* heap_page);
+void initialize_heap_slab(heap_slab_t* slab, uint32_t size_class);
+void* slab_alloc(uint32_t size_class);
+void slab_free(heap_slab_t* slab, void* ptr);
+void* span_alloc(size_t bytes);
+void span_free(heap_span_t* span, void* ptr);
+void* slab_realloc(heap_slab_t* slab, void* ptr, size_t bytes);
+void* span_realloc(heap_span_t* span, void* ptr, size_t bytes);
+void* heap_page_realloc(heap_page_t* heap_page, void* ptr, size_t bytes);
+void* move_allocation(void* ptr, size_t old_bytes, size_t bytes);
+int32_t get_allocation_start_block(heap_page_t* heap_page, void* ptr);
+size_t get_allocation_block_count(heap_page_t* heap_page, size_t block_num);
+int32_t get_slab_object(heap_slab_t* slab, void* ptr);
 heap_page_t* get_fitting_heap_page(heap_page_list_t* heap_page_list,
                                    size_t blocks_to_alloc);
 int32_t find_fitting_block_start(heap_page_t* heap_page,
@@ -12,35 +33,103 @@ int32_t find_fitting_block_start(heap_page_t* heap_page,
 void allocate_blocks(heap_page_t* heap_page,
                      int32_t first_fitting_block,
                      size_t blocks_to_alloc);
+void update_free_run_index(heap_page_t* heap_page);
+void coalesce_free_blocks(heap_page_t* heap_page,
+                          size_t first_block,
+                          size_t num_blocks);
 
-inline static bool is_aligned(void* relative_ptr) {
-  return (uint32_t) relative_ptr % HEAP_BLOCK_SIZE == 0;
+_Static_assert(sizeof(heap_slab_t) == PAGE_SIZE,
+               "heap_slab_t header must be HEAP_SLAB_HEADER_SIZE bytes");
+_Static_assert(sizeof(heap_span_t) == HEAP_SPAN_HEADER_SIZE,
+               "heap_span_t header must be HEAP_SPAN_HEADER_SIZE bytes");
+_Static_assert(sizeof(heap_redzone_t) == HEAP_REDZONE_SIZE,
+               "heap_redzone_t must be HEAP_REDZONE_SIZE bytes");
+
+// Object sizes served by the slabs, smallest first
+static const uint32_t heap_size_classes_[HEAP_SLAB_CLASS_COUNT] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+// Maps the number of 16 byte blocks a request needs to its size class
+static uint8_t heap_size_class_lookup_[HEAP_SLAB_MAX_SIZE / HEAP_BLOCK_SIZE + 1];
+
+// Slabs of each size class that still have free objects
+static heap_slab_list_t heap_slab_classes_[HEAP_SLAB_CLASS_COUNT];
+
+// Number of heap pages and slabs with nothing allocated in them
+static size_t heap_empty_pages_ = 0;
+
+// Counters behind get_heap_stats. The ones that need a walk of the heap
+// pages are only filled in the copies get_heap_stats hands out.
+static heap_stats_t heap_stats_;
+
+// Profiling epoch of the current (or last) memory leak run
+static uint32_t memory_tracker_epoch_ = 0;
+
+// Backs count heap pages starting at addr. With HEAP_DEMAND_PAGING the page
+// fault handler backs each on its first touch instead.
+static bool map_heap_pages(virtual_addr addr, uint32_t count) {
+#if HEAP_DEMAND_PAGING
+  (void) addr;
+  (void) count;
+  return true;
+#else
+  return alloc_range(addr, count);
+#endif
 }
 
-inline static bool map_check(unsigned char* bitmap, size_t block) {
-  if (block > HEAP_BLOCK_COUNT) {
-    return false;
+// Takes count contiguous pages of kernel addresses for the heap. Returns 0
+// if there is no room or the pages can't be backed.
+static virtual_addr request_heap_pages(uint32_t count) {
+  virtual_addr addr = vmem_alloc(count);
+  if (addr && !map_heap_pages(addr, count)) {
+    vmem_free(addr, count);
+    return 0;
   }
-  return bitmap[block / 8] & (1 << (block % 8));
+  if (addr) {
+    heap_stats_.bytes_mapped += count * PAGE_SIZE;
+  }
+  return addr;
 }
 
-inline static void map_set(unsigned char* bitmap, size_t block) {
-  if (block > HEAP_BLOCK_COUNT) {
-    return;
-  }
-  bitmap[block / 8] |= (1 << (block % 8));
+// Gives count pages of the heap back to vmem, which unmaps them
+static void free_heap_pages(virtual_addr addr, uint32_t count) {
+  heap_stats_.bytes_mapped -= count * PAGE_SIZE;
+  vmem_free(addr, count);
 }
 
-inline static void map_unset(unsigned char* bitmap, size_t block) {
-  if (block > HEAP_BLOCK_COUNT) {
-    return;
+// Bucket of the latency histogram for a call that took cycles TSC cycles
+inline static uint32_t latency_bucket(uint64_t cycles) {
+  if (cycles >> 32) {
+    return HEAP_LATENCY_BUCKET_COUNT - 1;
   }
-  bitmap[block / 8] &= ~(1 << (block % 8));
+  uint32_t bucket = cycles ? 31 - __builtin_clz((uint32_t) cycles) : 0;
+  return bucket < HEAP_LATENCY_BUCKET_COUNT
+         ? bucket : HEAP_LATENCY_BUCKET_COUNT - 1;
+}
+
+inline static bool is_aligned(void* relative_ptr) {
+  return (uint32_t) relative_ptr % HEAP_BLOCK_SIZE == 0;
 }
 
 void kernel_heap_init() {
   heap_page_list_.head = NULL;
-  cur_heap_addr_ = HEAP_VIRT_ADDR_START;
+  heap_empty_pages_ = 0;
+  memset(&heap_stats_, 0x0, sizeof(heap_stats_));
+
+  // Precompute the size class of every block count a slab can serve, so
+  // picking a class on kmalloc is a single table lookup
+  uint32_t size_class = 0;
+  for (size_t blocks = 0; blocks <= HEAP_SLAB_MAX_SIZE / HEAP_BLOCK_SIZE;
+       blocks++) {
+    while (heap_size_classes_[size_class] < blocks * HEAP_BLOCK_SIZE) {
+      size_class++;
+    }
+    heap_size_class_lookup_[blocks] = size_class;
+  }
+  for (size_t i = 0; i < HEAP_SLAB_CLASS_COUNT; i++) {
+    heap_slab_classes_[i].head = NULL;
+  }
   printf("Kernel heap installed.\n");
 }
 
@@ -56,12 +145,163 @@ void kernel_heap_init() {
 // }
 
 
-// TODO(psamora) Make it work for > 4000 bytes, refactor
+#if HEAP_DEBUG
+// End of the back redzone of the allocation after redzone
+static unsigned char* redzone_end(heap_redzone_t* redzone) {
+  if (redzone->guard_pages) {
+    return (unsigned char*) redzone + redzone->guard_pages * PAGE_SIZE;
+  }
+  return (unsigned char*) (redzone + 1) + redzone->size + HEAP_REDZONE_SIZE;
+}
+
+// Gives bytes pages of their own followed by a guard page, so accesses
+// past them fault. Returns NULL if there is no room.
+static heap_redzone_t* alloc_guarded(size_t bytes) {
+  uint32_t pages = HEAP_SPAN_PAGES_NEED_FOR_N_BYTES(bytes + HEAP_REDZONE_SIZE);
+  virtual_addr addr = request_heap_pages(pages + 1);
+  if (!addr) {
+    return NULL;
+  }
+  if (!map_guard_page(addr + pages * PAGE_SIZE, addr)) {
+    free_heap_pages(addr, pages + 1);
+    return NULL;
+  }
+
+  heap_redzone_t* redzone = (heap_redzone_t*) addr;
+  redzone->guard_pages = pages;
+  heap_stats_.span_allocs++;
+  heap_stats_.spans++;
+  increase_memory_tracker(bytes);
+  return redzone;
+}
+
+// Allocates bytes between two redzones, recording site in the front one
+static void* debug_alloc(size_t bytes, void* site) {
+  if (bytes == 0 || bytes > VMEM_MAX_PAGES * PAGE_SIZE) {
+    return NULL;
+  }
+
+  heap_redzone_t* redzone;
+  if (HEAP_DEBUG_GUARD_PAGES && bytes > HEAP_SLAB_MAX_SIZE) {
+    redzone = alloc_guarded(bytes);
+  } else {
+    redzone = heap_alloc(sizeof(heap_redzone_t) + bytes + HEAP_REDZONE_SIZE);
+    if (redzone) {
+      redzone->guard_pages = 0;
+    }
+  }
+  if (!redzone) {
+    return NULL;
+  }
+
+  redzone->size = bytes;
+  redzone->site = site;
+  redzone->checksum = REDZONE_CHECKSUM;
+  unsigned char* memory = (unsigned char*) (redzone + 1);
+  memset(memory + bytes, HEAP_REDZONE_BYTE,
+         redzone_end(redzone) - (memory + bytes));
+  return memory;
+}
+
+// Returns the front redzone of the allocation at ptr, or NULL if it isn't
+// allocated. Reports the first overwritten byte of the back redzone.
+static heap_redzone_t* check_redzones(void* ptr) {
+  heap_redzone_t* redzone = (heap_redzone_t*) ptr - 1;
+  if (redzone->checksum != REDZONE_CHECKSUM) {
+    printf("NOT ALLOCATED 5\n");
+    return NULL;
+  }
+
+  unsigned char* end = redzone_end(redzone);
+  for (unsigned char* byte = (unsigned char*) ptr + redzone->size;
+       byte < end; byte++) {
+    if (*byte != HEAP_REDZONE_BYTE) {
+      printf("HEAP OVERFLOW AT %x, %u BYTES ALLOCATED BY %x\n",
+             (uint32_t) byte, redzone->size, (uint32_t) redzone->site);
+      break;
+    }
+  }
+  return redzone;
+}
+
+static void debug_free(heap_redzone_t* redzone) {
+  redzone->checksum = 0;
+  if (!redzone->guard_pages) {
+    heap_free(redzone);
+    return;
+  }
+
+  // Unmapping the guard page clears it too
+  heap_stats_.spans--;
+  decrease_memory_tracker(redzone->size);
+  free_heap_pages((virtual_addr) redzone, redzone->guard_pages + 1);
+}
+
+// Always moves the allocation, so stale pointers to the old one stand out
+static void* debug_realloc(void* ptr, size_t bytes, void* site) {
+  if (!ptr) {
+    return debug_alloc(bytes, site);
+  }
+  if (bytes == 0) {
+    kfree(ptr);
+    return NULL;
+  }
+
+  heap_redzone_t* redzone = (heap_redzone_t*) ptr - 1;
+  if (redzone->checksum != REDZONE_CHECKSUM) {
+    printf("NOT ALLOCATED 5\n");
+    return NULL;
+  }
+  void* new_ptr = debug_alloc(bytes, site);
+  if (!new_ptr) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, redzone->size < bytes ? redzone->size : bytes);
+  kfree(ptr);
+  return new_ptr;
+}
+#endif
+
+// Allocates bytes for site, the caller of kmalloc or kcalloc, timing it
+// for the latency histogram
+static void* timed_alloc(size_t bytes, void* site) {
+  uint64_t start = rdtsc();
+#if HEAP_DEBUG
+  void* ptr = debug_alloc(bytes, site);
+#else
+  void* ptr = heap_alloc(bytes);
+#endif
+  heap_stats_.latency_histogram[latency_bucket(rdtsc() - start)]++;
+#if HEAP_PROFILE_SITES
+  if (ptr) {
+    heap_profile_alloc(ptr, bytes, site);
+  }
+#else
+  (void) site;
+#endif
+  return ptr;
+}
+
 void* kmalloc(size_t bytes) {
-  if (bytes == 0 || bytes > HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE) {
+  return timed_alloc(bytes, __builtin_return_address(0));
+}
+
+void* heap_alloc(size_t bytes) {
+  if (bytes == 0) {
     return NULL;
   }
 
+  // Allocations that don't fit in a heap page get pages of their own
+  if (bytes > HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE) {
+    return span_alloc(bytes);
+  }
+
+  // Small allocations are served in O(1) by the slab of their size class
+  int32_t size_class = get_size_class(bytes);
+  if (size_class != -1) {
+    return slab_alloc(size_class);
+  }
+
   size_t blocks_to_alloc = HEAP_BLOCKS_NEED_FOR_N_BYTES(bytes);
 
   // Find the first heap page that can fit our requested memory
@@ -71,8 +311,10 @@ void* kmalloc(size_t bytes) {
   // If we can't find a heap page that might fit the bytes, request a new
   // block of 4KB and try mallocing on it
   if (!free_heap_page) {
-    request_memory(cur_heap_addr_);
-    return kmalloc(bytes);
+    if (!request_memory()) {
+      return NULL;
+    }
+    return heap_alloc(bytes);
   }
 
   // Tries to fiend a sequence of blocks that can fit the bytes in the heap
@@ -80,20 +322,33 @@ void* kmalloc(size_t bytes) {
   int32_t first_fitting_block = find_fitting_block_start(free_heap_page,
                                                          blocks_to_alloc);
   if (first_fitting_block == -1) {
-    request_memory(cur_heap_addr_);
-    return kmalloc(bytes);    
+    if (!request_memory()) {
+      return NULL;
+    }
+    return heap_alloc(bytes);
   }
 
   // Success! Populate the bitmaps in the heap page to indicate that we 
   // allocated the memory
+  if (free_heap_page->num_available_blocks == HEAP_BLOCK_COUNT) {
+    heap_empty_pages_--;
+  }
   allocate_blocks(free_heap_page, first_fitting_block, blocks_to_alloc);
+  heap_stats_.heap_page_allocs++;
 
   increase_memory_tracker(blocks_to_alloc * HEAP_BLOCK_SIZE);
   return &free_heap_page->alloc_memory[first_fitting_block * HEAP_BLOCK_SIZE];
 }
 
 void* kcalloc(size_t bytes) {
-  void* ptr = kmalloc(bytes);
+  void* ptr = timed_alloc(bytes, __builtin_return_address(0));
+#if HEAP_DEMAND_PAGING
+  // Spans always get addresses vmem_free left unmapped, which the page fault
+  // handler backs with zeroed blocks
+  if (bytes > HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE) {
+    return ptr;
+  }
+#endif
   if (ptr != NULL) {
     memset(ptr, 0x0, bytes);
   }
@@ -105,6 +360,22 @@ void kfree(void* ptr) {
     printf("NOT ALLOCATED 1\n");
     return;
   }
+
+#if HEAP_PROFILE_SITES
+  heap_profile_free(ptr);
+#endif
+
+#if HEAP_DEBUG
+  heap_redzone_t* redzone = check_redzones(ptr);
+  if (redzone) {
+    debug_free(redzone);
+  }
+#else
+  heap_free(ptr);
+#endif
+}
+
+void heap_free(void* ptr) {
   heap_page_t* heap_page = get_heap_block_metadata(ptr);
 
   // Checks if we are actually freeing a malloced heap block
@@ -114,70 +385,485 @@ void kfree(void* ptr) {
     return;
   }
 
+  if (heap_page->kind == HEAP_PAGE_SLAB) {
+    slab_free((heap_slab_t*) heap_page, ptr);
+    return;
+  }
+
+  if (heap_page->kind == HEAP_PAGE_SPAN) {
+    span_free((heap_span_t*) heap_page, ptr);
+    return;
+  }
+
+  int32_t block_num = get_allocation_start_block(heap_page, ptr);
+  if (block_num == -1) {
+    // abort
+    return;
+  }
+
+  // Unset the first block in the first_alloced_bitmap since it won't be the
+  // first anymore, and free the allocation from the alloced_block_bitmap
+  size_t alloc_block_size = get_allocation_block_count(heap_page, block_num);
+  bitmap_unset(heap_page->first_alloced_bitmap, block_num);
+  bitmap_unset_range(heap_page->alloced_block_bitmap, block_num,
+                     alloc_block_size);
+
+  heap_page->num_available_blocks += alloc_block_size;
+  coalesce_free_blocks(heap_page, block_num, alloc_block_size);
+  decrease_memory_tracker(alloc_block_size * HEAP_BLOCK_SIZE);
+
+  if (heap_page->num_available_blocks == HEAP_BLOCK_COUNT) {
+    if (heap_empty_pages_ < HEAP_MAX_EMPTY_PAGES) {
+      heap_empty_pages_++;
+    } else {
+      release_heap_page(heap_page);
+    }
+  }
+}
+
+void* krealloc(void* ptr, size_t bytes) {
+#if HEAP_DEBUG
+  void* new_ptr = debug_realloc(ptr, bytes, __builtin_return_address(0));
+#else
+  void* new_ptr = heap_realloc(ptr, bytes);
+#endif
+#if HEAP_PROFILE_SITES
+  // Moved allocations were recorded by the kmalloc inside the heap, give
+  // them (and the ones resized in place) to our caller
+  if (new_ptr) {
+    heap_profile_alloc(new_ptr, bytes, __builtin_return_address(0));
+  }
+#endif
+  return new_ptr;
+}
+
+void* heap_realloc(void* ptr, size_t bytes) {
+  if (!ptr) {
+    return kmalloc(bytes);
+  }
+  if (bytes == 0) {
+    kfree(ptr);
+    return NULL;
+  }
+  heap_page_t* heap_page = get_heap_block_metadata(ptr);
+
+  // Checks if we are actually resizing a malloced heap block
+  if (heap_page->checksum != MALLOCED_CHECKSUM) {
+    printf("NOT ALLOCATED 2\n");
+    // abort
+    return NULL;
+  }
+
+  if (heap_page->kind == HEAP_PAGE_SLAB) {
+    return slab_realloc((heap_slab_t*) heap_page, ptr, bytes);
+  }
+
+  if (heap_page->kind == HEAP_PAGE_SPAN) {
+    return span_realloc((heap_span_t*) heap_page, ptr, bytes);
+  }
+
+  return heap_page_realloc(heap_page, ptr, bytes);
+}
+
+// Moves an allocation into a new one of the given size, copying over the
+// bytes both have in common. The old allocation is only freed on success.
+void* move_allocation(void* ptr, size_t old_bytes, size_t bytes) {
+  void* new_ptr = kmalloc(bytes);
+  if (!new_ptr) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, old_bytes < bytes ? old_bytes : bytes);
+  kfree(ptr);
+  return new_ptr;
+}
+
+// Resizes an allocation in a heap page in place when the blocks it needs
+// are right after it and free, otherwise moves it.
+void* heap_page_realloc(heap_page_t* heap_page, void* ptr, size_t bytes) {
+  int32_t block_num = get_allocation_start_block(heap_page, ptr);
+  if (block_num == -1) {
+    // abort
+    return NULL;
+  }
+
+  size_t alloc_block_size = get_allocation_block_count(heap_page, block_num);
+  if (bytes > HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE) {
+    return move_allocation(ptr, alloc_block_size * HEAP_BLOCK_SIZE, bytes);
+  }
+
+  size_t blocks_to_alloc = HEAP_BLOCKS_NEED_FOR_N_BYTES(bytes);
+  if (blocks_to_alloc <= alloc_block_size) {
+    // Shrinking, hand the tail blocks back to the heap page
+    bitmap_unset_range(heap_page->alloced_block_bitmap,
+                       block_num + blocks_to_alloc,
+                       alloc_block_size - blocks_to_alloc);
+    heap_page->num_available_blocks += alloc_block_size - blocks_to_alloc;
+    coalesce_free_blocks(heap_page, block_num + blocks_to_alloc,
+                         alloc_block_size - blocks_to_alloc);
+    resize_memory_tracker(alloc_block_size * HEAP_BLOCK_SIZE,
+                          blocks_to_alloc * HEAP_BLOCK_SIZE);
+    return ptr;
+  }
+
+  // Growing, check if the blocks following the allocation are free
+  if (block_num + blocks_to_alloc > HEAP_BLOCK_COUNT
+      || !bitmap_is_range_unset(heap_page->alloced_block_bitmap,
+                                block_num + alloc_block_size,
+                                blocks_to_alloc - alloc_block_size)) {
+    return move_allocation(ptr, alloc_block_size * HEAP_BLOCK_SIZE, bytes);
+  }
+
+  bitmap_set_range(heap_page->alloced_block_bitmap,
+                   block_num + alloc_block_size,
+                   blocks_to_alloc - alloc_block_size);
+  heap_page->num_available_blocks -= blocks_to_alloc - alloc_block_size;
+  update_free_run_index(heap_page);
+  resize_memory_tracker(alloc_block_size * HEAP_BLOCK_SIZE,
+                        blocks_to_alloc * HEAP_BLOCK_SIZE);
+  return ptr;
+}
+
+// Returns the block number of the allocation starting at ptr in the heap
+// page, or -1 if ptr isn't the start of an allocation
+int32_t get_allocation_start_block(heap_page_t* heap_page, void* ptr) {
   void* relative_addr = (void*) (uint32_t) ptr
                                 - (uint32_t) heap_page->alloc_memory;
 
   // Checks if this relative pointer is actually aligned to a block start
   if (!is_aligned(relative_addr)) {
     printf("NOT ALLOCATED 3\n");
-    // abort
-    return;
+    return -1;
   }
 
   // Get the block number for this pointer
   size_t block_num = ((virtual_addr) relative_addr) / HEAP_BLOCK_SIZE;
 
-  // Check in the first_alloced_bitmap if this is the start of the allocation 
-  if (map_check(heap_page->first_alloced_bitmap, block_num) == false) {
-    // abort
+  // Check in the first_alloced_bitmap if this is the start of the allocation
+  if (block_num >= HEAP_BLOCK_COUNT
+      || !bitmap_test(heap_page->first_alloced_bitmap, block_num)) {
     printf("NOT ALLOCATED 4\n");
-    return;
-  }
-
-  // Unset the first block in the first_alloced_bitmap since it won't be the
-  // first anymore
-  map_unset(heap_page->first_alloced_bitmap, block_num);
-
-  // Free the allocation from the alloced_block_bitmap for all blocks
-  // by using the first_alloced_bitmap to find the start of the next alloc
-  size_t alloc_block_size = 0;
-  for (size_t i = block_num; i < HEAP_BLOCK_COUNT; i++) {
-    bool is_first = map_check(heap_page->first_alloced_bitmap, i);
-    bool is_alloced = map_check(heap_page->alloced_block_bitmap, i);
-    if (is_first) {
-      // We found the start of the next alloc, stop.
-      break;
-    }
-    if (!is_alloced) {
-      // We found memory that isn't allocated, stop.
-      break;
-    }
-    map_unset(heap_page->alloced_block_bitmap, i);
-    alloc_block_size++;
+    return -1;
   }
+  return block_num;
+}
 
-  heap_page->num_available_blocks += alloc_block_size;
-  decrease_memory_tracker(alloc_block_size * HEAP_BLOCK_SIZE);
+// Returns how many blocks the allocation starting at block_num spans. It
+// ends at the start of the next alloc or at the first free block, whichever
+// comes first.
+size_t get_allocation_block_count(heap_page_t* heap_page, size_t block_num) {
+  size_t next_first = bitmap_find_next_set(heap_page->first_alloced_bitmap,
+                                           HEAP_BLOCK_COUNT, block_num + 1);
+  size_t next_free = bitmap_find_next_unset(heap_page->alloced_block_bitmap,
+                                            next_first, block_num + 1);
+  return next_free - block_num;
 }
 
-// Requests 4KB from the virtual memory to be owned by the heap
-void request_memory() {
-  heap_page_t* new_heap_page = (heap_page_t*) cur_heap_addr_;
-  if (!alloc_page(cur_heap_addr_)) {
-    // abort
-    return;
+// Requests 4KB from the virtual memory to be owned by the heap, as a new
+// heap page at the head of the list. Returns false if out of virtual or
+// physical memory.
+bool request_memory() {
+  heap_page_t* new_heap_page = (heap_page_t*) request_heap_pages(1);
+  if (!new_heap_page) {
+    return false;
   }
+#if !HEAP_DEMAND_PAGING
+  // Demand paged heap pages already come zeroed
   memset(new_heap_page, 0x0, PAGE_SIZE / 8);
+#endif
   heap_page_t* current_head = heap_page_list_.head;
   heap_page_list_.head = new_heap_page;
   new_heap_page->next = current_head;
+  new_heap_page->prev = NULL;
+  if (current_head) {
+    current_head->prev = new_heap_page;
+  }
   initialize_heap_page(new_heap_page);
-  cur_heap_addr_ += PAGE_SIZE;
+  heap_empty_pages_++;
+  heap_stats_.heap_pages++;
+  return true;
+}
+
+// Unlinks an empty heap page and gives it back
+void release_heap_page(heap_page_t* heap_page) {
+  if (heap_page->prev) {
+    heap_page->prev->next = heap_page->next;
+  } else {
+    heap_page_list_.head = heap_page->next;
+  }
+  if (heap_page->next) {
+    heap_page->next->prev = heap_page->prev;
+  }
+  heap_page->checksum = 0;
+  heap_stats_.heap_pages--;
+  free_heap_pages((virtual_addr) heap_page, 1);
 }
 
 void initialize_heap_page(heap_page_t* heap_page) {
   heap_page->checksum = MALLOCED_CHECKSUM;
+  heap_page->kind = HEAP_PAGE_BLOCKS;
   heap_page->num_available_blocks = HEAP_BLOCK_COUNT;
+  heap_page->largest_free_run = HEAP_BLOCK_COUNT;
+  heap_page->largest_free_run_start = 0;
+}
+
+// Requests 4KB from the virtual memory and turns it into a slab for the
+// given size class, added to the front of that class' slab list
+heap_slab_t* request_slab(uint32_t size_class) {
+  heap_slab_t* slab = (heap_slab_t*) request_heap_pages(1);
+  if (!slab) {
+    // abort
+    return NULL;
+  }
+
+  initialize_heap_slab(slab, size_class);
+  heap_slab_list_t* slab_list = &heap_slab_classes_[size_class];
+  slab->next = slab_list->head;
+  if (slab_list->head) {
+    slab_list->head->prev = slab;
+  }
+  slab_list->head = slab;
+  heap_empty_pages_++;
+  heap_stats_.slabs++;
+  return slab;
+}
+
+// Unlinks an empty slab from its class list and gives it back
+void release_slab(heap_slab_t* slab) {
+  heap_slab_list_t* slab_list = &heap_slab_classes_[slab->size_class];
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    slab_list->head = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->checksum = 0;
+  heap_stats_.slabs--;
+  free_heap_pages((virtual_addr) slab, 1);
+}
+
+inline static uint32_t slab_capacity(heap_slab_t* slab) {
+  return HEAP_SLAB_MEMORY_SIZE / slab->object_size;
+}
+
+void initialize_heap_slab(heap_slab_t* slab, uint32_t size_class) {
+  slab->checksum = MALLOCED_CHECKSUM;
+  slab->kind = HEAP_PAGE_SLAB;
+  slab->size_class = size_class;
+  slab->object_size = heap_size_classes_[size_class];
+  slab->num_free = HEAP_SLAB_MEMORY_SIZE / slab->object_size;
+  slab->prev = NULL;
+  slab->next = NULL;
+  memset(slab->alloced_object_bitmap, 0x0,
+         sizeof(slab->alloced_object_bitmap));
+
+  // Chain every object into the free list, lowest address first
+  slab->free_list = NULL;
+  for (size_t i = slab->num_free; i > 0; i--) {
+    void** object = (void**) &slab->alloc_memory[(i - 1) * slab->object_size];
+    *object = slab->free_list;
+    slab->free_list = object;
+  }
+}
+
+// Pops an object from the first slab of the size class with free objects.
+// Full slabs are unlinked from the class list until an object is freed.
+void* slab_alloc(uint32_t size_class) {
+  heap_slab_list_t* slab_list = &heap_slab_classes_[size_class];
+  heap_slab_t* slab = slab_list->head;
+  if (!slab) {
+    slab = request_slab(size_class);
+    if (!slab) {
+      return NULL;
+    }
+  }
+
+  if (slab->num_free == slab_capacity(slab)) {
+    heap_empty_pages_--;
+  }
+  void** object = slab->free_list;
+  slab->free_list = *object;
+  slab->num_free--;
+  bitmap_set(slab->alloced_object_bitmap,
+             ((unsigned char*) object - slab->alloc_memory) / slab->object_size);
+
+  if (slab->num_free == 0) {
+    slab_list->head = slab->next;
+    if (slab->next) {
+      slab->next->prev = NULL;
+    }
+    slab->next = NULL;
+  }
+
+  heap_stats_.size_class_allocs[size_class]++;
+  increase_memory_tracker(slab->object_size);
+  return object;
+}
+
+void slab_free(heap_slab_t* slab, void* ptr) {
+  int32_t object_num = get_slab_object(slab, ptr);
+  if (object_num == -1) {
+    // abort
+    return;
+  }
+  bitmap_unset(slab->alloced_object_bitmap, object_num);
+
+  unsigned char* object = ptr;
+  *(void**) object = slab->free_list;
+  slab->free_list = object;
+  slab->num_free++;
+
+  // The slab was full, so it isn't on its class list anymore. Put it back.
+  if (slab->num_free == 1) {
+    heap_slab_list_t* slab_list = &heap_slab_classes_[slab->size_class];
+    slab->prev = NULL;
+    slab->next = slab_list->head;
+    if (slab_list->head) {
+      slab_list->head->prev = slab;
+    }
+    slab_list->head = slab;
+  }
+
+  decrease_memory_tracker(slab->object_size);
+
+  if (slab->num_free == slab_capacity(slab)) {
+    if (heap_empty_pages_ < HEAP_MAX_EMPTY_PAGES) {
+      heap_empty_pages_++;
+    } else {
+      release_slab(slab);
+    }
+  }
+}
+
+// Takes enough contiguous pages to fit bytes after the span header.
+// Returns NULL if there is no room or the memory can't be backed.
+void* span_alloc(size_t bytes) {
+  // Bigger than the whole region, which also keeps the page count from
+  // overflowing
+  if (bytes > VMEM_MAX_PAGES * PAGE_SIZE) {
+    return NULL;
+  }
+
+  uint32_t num_pages = HEAP_SPAN_PAGES_NEED_FOR_N_BYTES(bytes);
+  virtual_addr span_addr = request_heap_pages(num_pages);
+  if (!span_addr) {
+    return NULL;
+  }
+
+  heap_span_t* span = (heap_span_t*) span_addr;
+  span->checksum = MALLOCED_CHECKSUM;
+  span->kind = HEAP_PAGE_SPAN;
+  span->num_pages = num_pages;
+  span->size = bytes;
+
+  heap_stats_.span_allocs++;
+  heap_stats_.spans++;
+  increase_memory_tracker(bytes);
+  return span->alloc_memory;
+}
+
+// Unmaps every page of the span, returning their frames to the PMM and
+// their addresses to vmem
+void span_free(heap_span_t* span, void* ptr) {
+  // Spans hold a single allocation, which starts right after the header
+  if (ptr != span->alloc_memory) {
+    printf("NOT ALLOCATED 3\n");
+    // abort
+    return;
+  }
+
+  virtual_addr span_addr = (virtual_addr) span;
+  uint32_t num_pages = span->num_pages;
+  decrease_memory_tracker(span->size);
+  span->checksum = 0;
+  heap_stats_.spans--;
+  free_heap_pages(span_addr, num_pages);
+}
+
+// Objects can grow in place up to their size class, past it they move
+void* slab_realloc(heap_slab_t* slab, void* ptr, size_t bytes) {
+  if (get_slab_object(slab, ptr) == -1) {
+    // abort
+    return NULL;
+  }
+
+  if (bytes <= slab->object_size) {
+    return ptr;
+  }
+  return move_allocation(ptr, slab->object_size, bytes);
+}
+
+// Returns the number of the alloced object starting at ptr in the slab, or
+// -1 if ptr isn't the start of an alloced object
+int32_t get_slab_object(heap_slab_t* slab, void* ptr) {
+  unsigned char* object = ptr;
+  size_t relative_addr = object - slab->alloc_memory;
+
+  // Checks if this pointer is actually the start of an object in the slab
+  if (object < slab->alloc_memory
+      || relative_addr % slab->object_size != 0) {
+    printf("NOT ALLOCATED 3\n");
+    return -1;
+  }
+
+  size_t object_num = relative_addr / slab->object_size;
+  if (!bitmap_test(slab->alloced_object_bitmap, object_num)) {
+    printf("NOT ALLOCATED 4\n");
+    return -1;
+  }
+  return object_num;
+}
+
+// Spans shrink by giving back their tail pages and grow in place only if
+// the addresses right after them are free, otherwise they move
+void* span_realloc(heap_span_t* span, void* ptr, size_t bytes) {
+  if (ptr != span->alloc_memory) {
+    printf("NOT ALLOCATED 3\n");
+    // abort
+    return NULL;
+  }
+
+  virtual_addr span_addr = (virtual_addr) span;
+  if (bytes > VMEM_MAX_PAGES * PAGE_SIZE) {
+    return NULL;
+  }
+
+  uint32_t num_pages = HEAP_SPAN_PAGES_NEED_FOR_N_BYTES(bytes);
+  virtual_addr span_end = span_addr + span->num_pages * PAGE_SIZE;
+  if (num_pages > span->num_pages) {
+    uint32_t extra_pages = num_pages - span->num_pages;
+    if (!vmem_extend(span_addr, span->num_pages, num_pages)) {
+      return move_allocation(ptr, span->size, bytes);
+    }
+    if (!map_heap_pages(span_end, extra_pages)) {
+      vmem_free(span_end, extra_pages);
+      return NULL;
+    }
+    heap_stats_.bytes_mapped += extra_pages * PAGE_SIZE;
+  } else if (num_pages < span->num_pages) {
+    free_heap_pages(span_addr + num_pages * PAGE_SIZE,
+                    span->num_pages - num_pages);
+  }
+
+  resize_memory_tracker(span->size, bytes);
+  span->num_pages = num_pages;
+  span->size = bytes;
+  return ptr;
+}
+
+int32_t get_size_class(size_t bytes) {
+  if (bytes == 0 || bytes > HEAP_SLAB_MAX_SIZE) {
+    return -1;
+  }
+  return heap_size_class_lookup_[HEAP_BLOCKS_NEED_FOR_N_BYTES(bytes)];
+}
+
+size_t get_size_class_size(uint32_t size_class) {
+  if (size_class >= HEAP_SLAB_CLASS_COUNT) {
+    return 0;
+  }
+  return heap_size_classes_[size_class];
 }
 
 // Returns the first existing heap page in the heap_page_list that can fit the
@@ -191,7 +877,9 @@ heap_page_t* get_fitting_heap_page(heap_page_list_t* heap_page_list,
 
   heap_page_t* cur = heap_page_list->head;
 
-  while (cur && cur->num_available_blocks < blocks_to_alloc) {
+  // Pages whose largest free run is too short can't fit the request, no
+  // matter how many blocks they have available in total
+  while (cur && cur->largest_free_run < blocks_to_alloc) {
     cur = cur->next;
   }
 
@@ -199,62 +887,103 @@ heap_page_t* get_fitting_heap_page(heap_page_list_t* heap_page_list,
 }
 
 // Given a Heap Page and the number of blocks_to_alloc, return the Heap
-// Block number of the first of a sequence of free blocks that can
-// fit blocks_to_alloc. Returns -1 if no sequence exists.
+// Block number of the shortest sequence of free blocks that can fit
+// blocks_to_alloc, so longer sequences are kept for larger requests.
+// Returns -1 if no sequence exists.
 int32_t find_fitting_block_start(heap_page_t* heap_page,
                                  size_t blocks_to_alloc) {
-  size_t starting_block = 0;
-  size_t starting_block_bit = 0;
-  size_t cur_block_num = 0;
-  for (size_t i = 0; i < HEAP_BLOCK_BIT_MAP_SIZE; i++) {
-    unsigned char cur_byte = heap_page->alloced_block_bitmap[i];
-    if (cur_byte == 0xFF) {
-      cur_block_num = 0;
-      continue;
-    }
-
-    for (size_t j = 0; j < 8; j++) {
-      int bit = 1 << j;
-      if (bit & cur_byte) {  // bit is set
-        cur_block_num = 0;
-        continue;
-      }
-
-      if (cur_block_num == 0) {
-        starting_block = i;
-        starting_block_bit = j;
-      }
-      cur_block_num += 1;
+  if (heap_page->largest_free_run < blocks_to_alloc) {
+    return -1;
+  }
 
-      if (cur_block_num == blocks_to_alloc) {
-        // We found a sequence that can fit, return the beginning block number
-        return (8 * starting_block) + starting_block_bit;
+  // The largest free run always fits, look for a shorter one that does too
+  size_t best_block = heap_page->largest_free_run_start;
+  size_t best_block_num = heap_page->largest_free_run;
+  uint32_t* bitmap = heap_page->alloced_block_bitmap;
+  size_t run_start = bitmap_find_next_unset(bitmap, HEAP_BLOCK_COUNT, 0);
+  while (run_start < HEAP_BLOCK_COUNT) {
+    size_t run_end = bitmap_find_next_set(bitmap, HEAP_BLOCK_COUNT, run_start);
+    size_t run_block_num = run_end - run_start;
+    if (run_block_num >= blocks_to_alloc && run_block_num < best_block_num) {
+      best_block = run_start;
+      best_block_num = run_block_num;
+      if (best_block_num == blocks_to_alloc) {
+        // Can't do better than an exact fit
+        break;
       }
     }
+    run_start = bitmap_find_next_unset(bitmap, HEAP_BLOCK_COUNT, run_end);
   }
-  return -1;
+  return best_block;
 }
 
 void allocate_blocks(heap_page_t* heap_page,
                      int32_t first_fitting_block,
                      size_t blocks_to_alloc) {
   // Mark the beginning of the block in the first_alloced_bitmap
-  map_set(heap_page->first_alloced_bitmap, first_fitting_block);
+  bitmap_set(heap_page->first_alloced_bitmap, first_fitting_block);
 
   // Mark all the alloced blocks in the alloced_block_bitmap
-  for (size_t i = first_fitting_block; 
-       i < first_fitting_block + blocks_to_alloc;
-       i++) {
-    map_set(heap_page->alloced_block_bitmap, i);
-  }
+  bitmap_set_range(heap_page->alloced_block_bitmap, first_fitting_block,
+                   blocks_to_alloc);
   // Update the num_available_blocks
   heap_page->num_available_blocks -= blocks_to_alloc;
+
+  // Only allocating from the largest free run can change which one it is
+  size_t largest_run_end = heap_page->largest_free_run_start
+                           + heap_page->largest_free_run;
+  if ((size_t) first_fitting_block < largest_run_end
+      && first_fitting_block + blocks_to_alloc
+         > heap_page->largest_free_run_start) {
+    update_free_run_index(heap_page);
+  }
+}
+
+// Rebuilds the free run index of the heap page from its bitmap
+void update_free_run_index(heap_page_t* heap_page) {
+  uint32_t* bitmap = heap_page->alloced_block_bitmap;
+  heap_page->largest_free_run = 0;
+  heap_page->largest_free_run_start = 0;
+  size_t run_start = bitmap_find_next_unset(bitmap, HEAP_BLOCK_COUNT, 0);
+  while (run_start < HEAP_BLOCK_COUNT) {
+    size_t run_end = bitmap_find_next_set(bitmap, HEAP_BLOCK_COUNT, run_start);
+    if (run_end - run_start > heap_page->largest_free_run) {
+      heap_page->largest_free_run = run_end - run_start;
+      heap_page->largest_free_run_start = run_start;
+    }
+    run_start = bitmap_find_next_unset(bitmap, HEAP_BLOCK_COUNT, run_end);
+  }
+}
+
+// Merges freshly freed blocks with the free blocks right before and after
+// them into a single free run, and records it in the free run index if it
+// became the largest one in the heap page
+void coalesce_free_blocks(heap_page_t* heap_page,
+                          size_t first_block,
+                          size_t num_blocks) {
+  uint32_t* bitmap = heap_page->alloced_block_bitmap;
+  size_t run_start = bitmap_find_prev_set(bitmap, first_block) + 1;
+  size_t run_end = bitmap_find_next_set(bitmap, HEAP_BLOCK_COUNT,
+                                        first_block + num_blocks);
+
+  if (run_end - run_start > heap_page->largest_free_run) {
+    heap_page->largest_free_run = run_end - run_start;
+    heap_page->largest_free_run_start = run_start;
+  }
 }
 
 heap_page_t* get_heap_block_metadata(void* ptr) {
   return (heap_page_t*) (((virtual_addr) ptr / PAGE_SIZE) * PAGE_SIZE);
 }
 
+heap_slab_t* get_heap_slab_metadata(void* ptr) {
+  return (heap_slab_t*) get_heap_block_metadata(ptr);
+}
+
+heap_span_t* get_heap_span_metadata(void* ptr) {
+  return (heap_span_t*) get_heap_block_metadata(ptr);
+}
+
 // Implementation for the heap memory leak checker functions
 
 // Reset previous memory leak run and start tracking memory usage
@@ -263,6 +992,8 @@ void track_memory_malloced() {
   memory_tracker_counter_alloc_count_ = 0;
   memory_tracker_counter_free_count_ = 0;
   memory_tracker_counter_bytes_ = 0;
+  heap_profile_next_epoch();
+  memory_tracker_epoch_ = heap_profile_epoch();
 }
 
 // Stop tracking memory leaks. You can still print_memory_report() after
@@ -285,9 +1016,15 @@ void print_memory_report(bool verbose) {
   }
   printf("Mallocs: %lu. Frees: %lu. \n",
     memory_tracker_counter_alloc_count_, memory_tracker_counter_free_count_);
+#if HEAP_PROFILE_SITES
+  if (memory_tracker_counter_bytes_ != 0) {
+    heap_profile_dump(HEAP_PROFILE_REPORT_SITES, memory_tracker_epoch_);
+  }
+#endif
 }
 
 void increase_memory_tracker(size_t bytes) {
+  heap_stats_.bytes_in_use += bytes;
   if (is_tracking_memory_) {
     memory_tracker_counter_alloc_count_ += 1;
     memory_tracker_counter_bytes_ += bytes;
@@ -295,12 +1032,116 @@ void increase_memory_tracker(size_t bytes) {
 }
 
 void decrease_memory_tracker(size_t bytes) {
+  heap_stats_.frees++;
+  heap_stats_.bytes_in_use -= bytes;
   if (is_tracking_memory_) {
     memory_tracker_counter_free_count_ += 1;
     memory_tracker_counter_bytes_ -= bytes;
   }
 }
 
-void force_empty_heap_page() {
+void resize_memory_tracker(size_t old_bytes, size_t new_bytes) {
+  heap_stats_.bytes_in_use += new_bytes;
+  heap_stats_.bytes_in_use -= old_bytes;
+  if (is_tracking_memory_) {
+    memory_tracker_counter_bytes_ += new_bytes;
+    memory_tracker_counter_bytes_ -= old_bytes;
+  }
+}
+
+void heap_report_guard_fault(virtual_addr owner) {
+  heap_redzone_t* redzone = (heap_redzone_t*) owner;
+  if (redzone->checksum != REDZONE_CHECKSUM) {
+    printf("GUARD PAGE OWNER %x ISN'T ALLOCATED\n", owner);
+    return;
+  }
+  printf("HEAP OVERFLOW PAST %x, %u BYTES ALLOCATED BY %x\n",
+         (uint32_t) (redzone + 1), redzone->size, (uint32_t) redzone->site);
+}
+
+// Implementation for the heap statistics
+
+void get_heap_stats(heap_stats_t* stats) {
+  *stats = heap_stats_;
 
+  size_t free_blocks = 0;
+  size_t largest_runs_blocks = 0;
+  size_t largest_free_run = 0;
+  for (heap_page_t* heap_page = heap_page_list_.head; heap_page;
+       heap_page = heap_page->next) {
+    free_blocks += heap_page->num_available_blocks;
+    largest_runs_blocks += heap_page->largest_free_run;
+    if (heap_page->largest_free_run > largest_free_run) {
+      largest_free_run = heap_page->largest_free_run;
+    }
+  }
+
+  stats->largest_free_run = largest_free_run * HEAP_BLOCK_SIZE;
+  stats->fragmentation = 0;
+  if (free_blocks > 0) {
+    stats->fragmentation =
+        (free_blocks - largest_runs_blocks) * 100 / free_blocks;
+  }
+}
+
+void print_heap_stats() {
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+
+  printf("Heap: %u bytes in use, %u bytes mapped\n",
+         stats.bytes_in_use, stats.bytes_mapped);
+  printf("Pages: %u heap pages, %u slabs, %u spans\n",
+         stats.heap_pages, stats.slabs, stats.spans);
+  printf("Largest free run: %u bytes. Fragmentation: %u percent\n",
+         stats.largest_free_run, stats.fragmentation);
+
+  printf("Allocs per size class:");
+  for (size_t i = 0; i < HEAP_SLAB_CLASS_COUNT; i++) {
+    printf(" %u:%lu", get_size_class_size(i), stats.size_class_allocs[i]);
+  }
+  printf("\nHeap page allocs: %lu. Span allocs: %lu. Frees: %lu.\n",
+         stats.heap_page_allocs, stats.span_allocs, stats.frees);
+
+  // Only print the buckets that saw calls, as 2^i:count
+  printf("kmalloc cycles:");
+  for (size_t i = 0; i < HEAP_LATENCY_BUCKET_COUNT; i++) {
+    if (stats.latency_histogram[i] != 0) {
+      printf(" 2^%u:%lu", i, stats.latency_histogram[i]);
+    }
+  }
+  printf("\n");
+}
+
+size_t heap_trim() {
+  size_t released = 0;
+  heap_page_t* heap_page = heap_page_list_.head;
+  while (heap_page) {
+    heap_page_t* next = heap_page->next;
+    if (heap_page->num_available_blocks == HEAP_BLOCK_COUNT) {
+      release_heap_page(heap_page);
+      released++;
+    }
+    heap_page = next;
+  }
+
+  // Empty slabs have free objects, so they are all on their class list
+  for (size_t i = 0; i < HEAP_SLAB_CLASS_COUNT; i++) {
+    heap_slab_t* slab = heap_slab_classes_[i].head;
+    while (slab) {
+      heap_slab_t* next = slab->next;
+      if (slab->num_free == slab_capacity(slab)) {
+        release_slab(slab);
+        released++;
+      }
+      slab = next;
+    }
+  }
+
+  heap_empty_pages_ = 0;
+  return released;
+}
+
+void force_empty_heap_page() {
+  heap_trim();
+  request_memory();
 }
\ No newline at end of file
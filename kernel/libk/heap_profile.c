@@ -0,0 +1,220 @@
+#include <libk/heap_profile.h>
+#include <stdio.h>
+#include <string.h>
+
+#if HEAP_PROFILE_SITES
+
+// A live allocation. Free slots have a NULL ptr.
+typedef struct heap_profile_entry_t {
+  void* ptr;
+  void* site;
+  size_t bytes;
+  uint32_t epoch;
+} heap_profile_entry_t;
+
+// Live allocations, open addressed with linear probing. It is never filled
+// past 3/4 so probe sequences stay short.
+static heap_profile_entry_t heap_profile_live_[HEAP_PROFILE_MAX_LIVE];
+static size_t heap_profile_live_count_ = 0;
+static unsigned long heap_profile_dropped_ = 0;
+static uint32_t heap_profile_epoch_ = 0;
+
+// Sites aggregated by the last walk of the live allocations
+static heap_profile_site_t heap_profile_sites_[HEAP_PROFILE_MAX_SITES];
+
+// Mixes the bits of an address into a slot of a table of the given power
+// of two size. Heap addresses share their low bits, so they are dropped.
+inline static uint32_t hash_address(void* addr, uint32_t slots) {
+  uint32_t hash = (uint32_t) addr >> 4;
+  hash ^= hash >> 16;
+  hash *= 0x45D9F3B;
+  hash ^= hash >> 16;
+  return hash & (slots - 1);
+}
+
+// Returns the slot holding ptr, or the empty slot it would go in
+static uint32_t find_live_slot(void* ptr) {
+  uint32_t slot = hash_address(ptr, HEAP_PROFILE_MAX_LIVE);
+  while (heap_profile_live_[slot].ptr
+         && heap_profile_live_[slot].ptr != ptr) {
+    slot = (slot + 1) & (HEAP_PROFILE_MAX_LIVE - 1);
+  }
+  return slot;
+}
+
+void heap_profile_alloc(void* ptr, size_t bytes, void* site) {
+  uint32_t slot = find_live_slot(ptr);
+  heap_profile_entry_t* entry = &heap_profile_live_[slot];
+  if (!entry->ptr) {
+    if (heap_profile_live_count_ >= HEAP_PROFILE_MAX_LIVE / 4 * 3) {
+      heap_profile_dropped_++;
+      return;
+    }
+    entry->ptr = ptr;
+    heap_profile_live_count_++;
+  }
+  entry->site = site;
+  entry->bytes = bytes;
+  entry->epoch = heap_profile_epoch_;
+}
+
+void heap_profile_free(void* ptr) {
+  uint32_t hole = find_live_slot(ptr);
+  if (!heap_profile_live_[hole].ptr) {
+    // Dropped when the table was full
+    return;
+  }
+  heap_profile_live_count_--;
+
+  // Shift back the entries after the hole that probed past it, so lookups
+  // never stop early at an empty slot
+  uint32_t mask = HEAP_PROFILE_MAX_LIVE - 1;
+  uint32_t slot = hole;
+  for (;;) {
+    slot = (slot + 1) & mask;
+    heap_profile_entry_t* entry = &heap_profile_live_[slot];
+    if (!entry->ptr) {
+      break;
+    }
+    uint32_t home = hash_address(entry->ptr, HEAP_PROFILE_MAX_LIVE);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      heap_profile_live_[hole] = *entry;
+      hole = slot;
+    }
+  }
+  heap_profile_live_[hole].ptr = NULL;
+}
+
+uint32_t heap_profile_epoch() {
+  return heap_profile_epoch_;
+}
+
+void heap_profile_next_epoch() {
+  heap_profile_epoch_++;
+}
+
+// Sums the live allocations made since since_epoch by site into the front
+// of heap_profile_sites_. Returns the number of sites.
+static size_t aggregate_sites(uint32_t since_epoch) {
+  memset(heap_profile_sites_, 0x0, sizeof(heap_profile_sites_));
+  for (size_t i = 0; i < HEAP_PROFILE_MAX_LIVE; i++) {
+    heap_profile_entry_t* entry = &heap_profile_live_[i];
+    if (!entry->ptr || entry->epoch < since_epoch) {
+      continue;
+    }
+
+    // Sites are a small table of their own, probed the same way. Once it is
+    // full, allocations of new sites are left out.
+    uint32_t slot = hash_address(entry->site, HEAP_PROFILE_MAX_SITES);
+    for (size_t probes = 0; probes < HEAP_PROFILE_MAX_SITES; probes++) {
+      heap_profile_site_t* site = &heap_profile_sites_[slot];
+      if (!site->site || site->site == entry->site) {
+        site->site = entry->site;
+        site->bytes += entry->bytes;
+        site->count++;
+        break;
+      }
+      slot = (slot + 1) & (HEAP_PROFILE_MAX_SITES - 1);
+    }
+  }
+
+  size_t num_sites = 0;
+  for (size_t i = 0; i < HEAP_PROFILE_MAX_SITES; i++) {
+    if (heap_profile_sites_[i].site) {
+      heap_profile_sites_[num_sites++] = heap_profile_sites_[i];
+    }
+  }
+  return num_sites;
+}
+
+// Moves the top n of the num_sites aggregated sites to the front, in order.
+// Returns how many were moved.
+static size_t select_top_sites(size_t num_sites, size_t n, bool by_count) {
+  if (n > num_sites) {
+    n = num_sites;
+  }
+  for (size_t i = 0; i < n; i++) {
+    size_t best = i;
+    for (size_t j = i + 1; j < num_sites; j++) {
+      size_t value = by_count ? heap_profile_sites_[j].count
+                              : heap_profile_sites_[j].bytes;
+      size_t best_value = by_count ? heap_profile_sites_[best].count
+                                   : heap_profile_sites_[best].bytes;
+      if (value > best_value) {
+        best = j;
+      }
+    }
+    heap_profile_site_t top = heap_profile_sites_[best];
+    heap_profile_sites_[best] = heap_profile_sites_[i];
+    heap_profile_sites_[i] = top;
+  }
+  return n;
+}
+
+size_t heap_profile_top_sites(heap_profile_site_t* sites,
+                              size_t max,
+                              bool by_count,
+                              uint32_t since_epoch) {
+  size_t num_sites = aggregate_sites(since_epoch);
+  size_t found = select_top_sites(num_sites, max, by_count);
+  memcpy(sites, heap_profile_sites_, found * sizeof(heap_profile_site_t));
+  return found;
+}
+
+static void print_top_sites(size_t n, bool by_count, uint32_t since_epoch) {
+  size_t num_sites = aggregate_sites(since_epoch);
+  size_t found = select_top_sites(num_sites, n, by_count);
+  printf("Top allocation sites by %s:\n", by_count ? "count" : "bytes");
+  for (size_t i = 0; i < found; i++) {
+    printf("  %x: %u bytes in %u allocations\n",
+           (uint32_t) heap_profile_sites_[i].site,
+           heap_profile_sites_[i].bytes, heap_profile_sites_[i].count);
+  }
+}
+
+void heap_profile_dump(size_t n, uint32_t since_epoch) {
+  print_top_sites(n, false, since_epoch);
+  print_top_sites(n, true, since_epoch);
+  if (heap_profile_dropped_ > 0) {
+    printf("%lu allocations weren't profiled, the table was full\n",
+           heap_profile_dropped_);
+  }
+}
+
+#else
+
+void heap_profile_alloc(void* ptr, size_t bytes, void* site) {
+  (void) ptr;
+  (void) bytes;
+  (void) site;
+}
+
+void heap_profile_free(void* ptr) {
+  (void) ptr;
+}
+
+uint32_t heap_profile_epoch() {
+  return 0;
+}
+
+void heap_profile_next_epoch() {
+}
+
+size_t heap_profile_top_sites(heap_profile_site_t* sites,
+                              size_t max,
+                              bool by_count,
+                              uint32_t since_epoch) {
+  (void) sites;
+  (void) max;
+  (void) by_count;
+  (void) since_epoch;
+  return 0;
+}
+
+void heap_profile_dump(size_t n, uint32_t since_epoch) {
+  (void) n;
+  (void) since_epoch;
+  printf("Heap profiling is off, build with HEAP_PROFILE_SITES=1\n");
+}
+
+#endif  // HEAP_PROFILE_SITES
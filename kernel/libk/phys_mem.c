@@ -2,99 +2,312 @@
 #include <string.h>
 
 #include <external/multiboot.h>
+#include <libk/bitmap.h>
 #include <libk/phys_mem.h>
 
-// Functions to manipulate the bitmap
-
-inline static void map_set(int bit) {
-  phys_memory_map_[bit / 32] |= (1 << (bit % 32));
+// Bit i of the summary is set if word i of phys_memory_map_ is full, so
+// searches skip 32 used blocks with a single bit test. Every word before
+// the cursor is full, searches for free blocks start at it.
+static uint32_t* phys_memory_summary_ = 0;
+static uint32_t phys_memory_cursor_ = 0;
+
+// Buddy allocator state. Bit i of the map of order k is set if the blocks
+// [i * 2^k, (i + 1) * 2^k) are free and not part of a larger free buddy.
+// The maps live right after the summary. The hint of an order is an
+// index with no set bit below it, so searches don't restart from 0.
+static uint32_t* phys_buddy_maps_[PHYS_BUDDY_ORDER_COUNT];
+static uint32_t phys_buddy_free_count_[PHYS_BUDDY_ORDER_COUNT];
+static uint32_t phys_buddy_hint_[PHYS_BUDDY_ORDER_COUNT];
+
+// Descriptors of every block, indexed by block number. They live right after
+// the buddy maps.
+static page_t* phys_pages_ = 0;
+
+// Functions to manipulate the bitmap. They keep the summary and the
+// cursor in sync with it.
+
+void map_update_summary(uint32_t block, uint32_t count) {
+  if (count == 0) {
+    return;
+  }
+  uint32_t last_word = (block + count - 1) / BITMAP_WORD_BITS;
+  for (uint32_t word = block / BITMAP_WORD_BITS; word <= last_word; word++) {
+    if (phys_memory_map_[word] == BITMAP_FULL_WORD) {
+      bitmap_set(phys_memory_summary_, word);
+    } else {
+      bitmap_unset(phys_memory_summary_, word);
+      if (word < phys_memory_cursor_) {
+        phys_memory_cursor_ = word;
+      }
+    }
+  }
 }
 
-inline static void map_unset(int bit) {
-  phys_memory_map_[bit / 32] &= ~(1 << (bit % 32));
+inline static void map_set_range(uint32_t block, uint32_t count) {
+  bitmap_set_range(phys_memory_map_, block, count);
+  map_update_summary(block, count);
 }
 
-inline static bool map_test(int bit) {
-  return phys_memory_map_[bit / 32] & (1 << (bit % 32));
+inline static void map_unset_range(uint32_t block, uint32_t count) {
+  bitmap_unset_range(phys_memory_map_, block, count);
+  map_update_summary(block, count);
 }
 
-int find_free_block() {
-  for (uint32_t i = 0; i < total_blocks_; i++) {
-    uint32_t block = phys_memory_map_[i];
-    if (block != 0xFFFFFFFF) {
-      for (uint8_t j = 0; j < 32; j++) {
-        int bit = 1 << j;
-        if (!(bit & block)) {
-          return (32 * i) + j;
-        }
-      }
+// Functions to search the bitmap
+
+// Returns the first free block from the given one onwards, or total_blocks_
+// if there is none. Full words are skipped through the summary.
+uint32_t find_next_free_block(uint32_t from) {
+  uint32_t num_words = BITMAP_WORDS_NEED_FOR_N_BITS(total_blocks_);
+  while (from < total_blocks_) {
+    uint32_t word = bitmap_find_next_unset(phys_memory_summary_, num_words,
+                                           from / BITMAP_WORD_BITS);
+    if (word == num_words) {
+      break;
+    }
+    if (word * BITMAP_WORD_BITS > from) {
+      from = word * BITMAP_WORD_BITS;
     }
+
+    uint32_t word_end = (word + 1) * BITMAP_WORD_BITS;
+    if (word_end > total_blocks_) {
+      word_end = total_blocks_;
+    }
+    uint32_t block = bitmap_find_next_unset(phys_memory_map_, word_end, from);
+    if (block < word_end) {
+      return block;
+    }
+    from = word_end;
   }
-  return -1;
+  return total_blocks_;
 }
 
 int find_free_blocks(uint32_t count) {
-  int starting_block = -1;
-  int starting_block_bit = -1;
-  uint32_t cur_block_num = 0;
-  for (uint32_t i = 0; i < total_blocks_; i++) {
-    uint32_t cur_block = phys_memory_map_[i];
-    if (cur_block == 0xFFFFFFFF) {
-      cur_block_num = 0;
-      continue;
+  if (count == 0) {
+    return -1;
+  }
+
+  // Jump from the start of each free run to the used block that ends it
+  uint32_t run_start = find_next_free_block(phys_memory_cursor_
+                                            * BITMAP_WORD_BITS);
+  while (run_start < total_blocks_ && count <= total_blocks_ - run_start) {
+    uint32_t run_end = bitmap_find_next_set(phys_memory_map_,
+                                            run_start + count, run_start);
+    if (run_end == run_start + count) {
+      return run_start;
     }
+    run_start = find_next_free_block(run_end);
+  }
+  return -1;
+}
 
-    for (uint8_t j = 0; j < 32; j++) {
-      int bit = 1 << j;
-      if (bit & cur_block) {  // bit is set
-        cur_block_num = 0;
-        continue;
-      }
+// Functions to manipulate the buddy maps
 
-      if (!cur_block_num) starting_block = i;
-      if (!cur_block_num) starting_block_bit = j;
-      cur_block_num += 1;
-      if (cur_block_num == count) {
-        return (32 * starting_block) + starting_block_bit;
-      }
+inline static uint32_t buddy_map_bits(uint32_t order) {
+  return total_blocks_ >> order;
+}
+
+inline static bool buddy_is_free(uint32_t block, uint32_t order) {
+  uint32_t index = block >> order;
+  if (index >= buddy_map_bits(order)) {
+    return false;
+  }
+  return bitmap_test(phys_buddy_maps_[order], index);
+}
+
+inline static void buddy_insert(uint32_t block, uint32_t order) {
+  uint32_t index = block >> order;
+  bitmap_set(phys_buddy_maps_[order], index);
+  phys_buddy_free_count_[order]++;
+  if (index < phys_buddy_hint_[order]) {
+    phys_buddy_hint_[order] = index;
+  }
+}
+
+inline static void buddy_remove(uint32_t block, uint32_t order) {
+  bitmap_unset(phys_buddy_maps_[order], block >> order);
+  phys_buddy_free_count_[order]--;
+}
+
+// Returns the lowest free buddy of the given order, or -1 if there is none
+int32_t buddy_find(uint32_t order) {
+  if (phys_buddy_free_count_[order] == 0) {
+    return -1;
+  }
+  uint32_t index = bitmap_find_next_set(phys_buddy_maps_[order],
+                                        buddy_map_bits(order),
+                                        phys_buddy_hint_[order]);
+  if (index == buddy_map_bits(order)) {
+    return -1;
+  }
+  phys_buddy_hint_[order] = index;
+  return index << order;
+}
+
+// Returns the order of the free buddy holding block, or -1 if block isn't
+// free
+int32_t buddy_order_of(uint32_t block) {
+  for (uint32_t order = 0; order <= PHYS_BUDDY_MAX_ORDER; order++) {
+    if (buddy_is_free(block & ~((1 << order) - 1), order)) {
+      return order;
     }
   }
   return -1;
 }
 
-// Functions to manage a single block in memory
-physical_addr alloc_block() {
-  if (total_blocks_ - used_blocks_ <= 0) {
-    return 0;
+// Takes the free buddy of the given order starting at block and hands back
+// its upper halves until only 2^order_wanted blocks are left
+void buddy_split(uint32_t block, uint32_t order, uint32_t order_wanted) {
+  buddy_remove(block, order);
+  while (order > order_wanted) {
+    order--;
+    buddy_insert(block + (1 << order), order);
   }
+}
 
-  int free_block = find_free_block();
-  if (free_block == -1) {
+// Returns a free buddy of the given order to the allocator, merging it with
+// its buddy for as long as the buddy is free too
+void buddy_free(uint32_t block, uint32_t order) {
+  while (order < PHYS_BUDDY_MAX_ORDER) {
+    uint32_t buddy = block ^ (1 << order);
+    if (!buddy_is_free(buddy, order)) {
+      break;
+    }
+    buddy_remove(buddy, order);
+    block &= ~(1 << order);
+    order++;
+  }
+  buddy_insert(block, order);
+}
+
+// Returns free blocks [block, block + count) to the buddy allocator as the
+// largest aligned buddies that fit
+void buddy_free_range(uint32_t block, uint32_t count) {
+  while (count > 0) {
+    uint32_t order = block ? __builtin_ctz(block) : PHYS_BUDDY_MAX_ORDER;
+    if (order > PHYS_BUDDY_MAX_ORDER) {
+      order = PHYS_BUDDY_MAX_ORDER;
+    }
+    while ((1u << order) > count) {
+      order--;
+    }
+    buddy_free(block, order);
+    block += 1 << order;
+    count -= 1 << order;
+  }
+}
+
+// Takes the free blocks [block, block + count) out of the buddies holding
+// them. What is left of those buddies outside the range stays free.
+void buddy_reserve_range(uint32_t block, uint32_t count) {
+  uint32_t end = block + count;
+  uint32_t cur = block;
+  while (cur < end) {
+    int32_t order = buddy_order_of(cur);
+    if (order == -1) {
+      // abort
+      return;
+    }
+    uint32_t buddy_start = cur & ~((1 << order) - 1);
+    uint32_t buddy_end = buddy_start + (1 << order);
+    buddy_remove(buddy_start, order);
+    if (buddy_start < block) {
+      buddy_free_range(buddy_start, block - buddy_start);
+    }
+    if (buddy_end > end) {
+      buddy_free_range(end, buddy_end - end);
+    }
+    cur = buddy_end;
+  }
+}
+
+// Points the summary, the buddy maps and the page descriptors at the memory
+// right after phys_memory_map_
+void place_phys_maps() {
+  uint32_t num_words = BITMAP_WORDS_NEED_FOR_N_BITS(total_blocks_);
+  phys_memory_summary_ = phys_memory_map_ + num_words;
+  uint32_t* map = phys_memory_summary_
+                  + BITMAP_WORDS_NEED_FOR_N_BITS(num_words);
+  for (uint32_t order = 0; order <= PHYS_BUDDY_MAX_ORDER; order++) {
+    phys_buddy_maps_[order] = map;
+    map += BITMAP_WORDS_NEED_FOR_N_BITS(buddy_map_bits(order));
+  }
+  phys_pages_ = (page_t*) map;
+}
+
+// Resets the descriptors of count blocks handed out or taken back
+inline static void reset_pages(uint32_t block, uint32_t count,
+                               uint16_t refcount) {
+  for (uint32_t i = block; i < block + count; i++) {
+    phys_pages_[i].refcount = refcount;
+    phys_pages_[i].mapcount = 0;
+    phys_pages_[i].flags = 0;
+  }
+}
+
+// Functions to manage a single block in memory
+
+// Takes the lowest free block
+physical_addr alloc_block() {
+  uint32_t block = find_next_free_block(phys_memory_cursor_
+                                        * BITMAP_WORD_BITS);
+  if (block == total_blocks_) {
     return 0;
   }
 
-  map_set(free_block);
-  uint32_t addr = free_block * PHYS_BLOCK_SIZE;
+  // Every word before the one holding the lowest free block is full
+  phys_memory_cursor_ = block / BITMAP_WORD_BITS;
+  map_set_range(block, 1);
+  buddy_reserve_range(block, 1);
+  reset_pages(block, 1, 1);
+  uint32_t addr = block * PHYS_BLOCK_SIZE;
   used_blocks_++;
   return addr;
 }
 
 void free_block(physical_addr addr) {
-  int block = addr / PHYS_BLOCK_SIZE;
-
-  map_unset(block);
-  used_blocks_--;
+  free_blocks(addr, 1);
 }
 
 bool is_alloced(physical_addr addr) {
   int block = addr / PHYS_BLOCK_SIZE;
-  return map_test(block);
+  return bitmap_test(phys_memory_map_, block);
+}
+
+// Functions to manage the page descriptors
+
+page_t* block_to_page(physical_addr addr) {
+  uint32_t block = addr / PHYS_BLOCK_SIZE;
+  if (block >= total_blocks_) {
+    return NULL;
+  }
+  return &phys_pages_[block];
+}
+
+void get_block(physical_addr addr) {
+  page_t* page = block_to_page(addr);
+  if (!page || !is_alloced(addr)) {
+    // abort
+    return;
+  }
+  page->refcount++;
+}
+
+void put_block(physical_addr addr) {
+  page_t* page = block_to_page(addr);
+  if (!page || page->refcount == 0) {
+    // abort
+    return;
+  }
+  if (--page->refcount == 0) {
+    free_block(addr);
+  }
 }
 
 // Functions to allocate multiple blocks of memory
 
 physical_addr alloc_blocks(uint32_t count) {
-  if (total_blocks_ - used_blocks_ <= 0) {
+  if (total_blocks_ - used_blocks_ < count) {
     return 0;
   }
 
@@ -103,41 +316,83 @@ physical_addr alloc_blocks(uint32_t count) {
     return 0;
   }
 
-  for (uint32_t i = 0; i < count; i++) {
-    map_set(free_block + i);
-  }
+  map_set_range(free_block, count);
+  buddy_reserve_range(free_block, count);
+  reset_pages(free_block, count, 1);
 
   uint32_t addr = free_block * PHYS_BLOCK_SIZE;
   used_blocks_ += count;
   return addr;
 }
 
-void free_blocks(physical_addr addr, uint32_t count) {
-  int block = addr / PHYS_BLOCK_SIZE;
+physical_addr alloc_blocks_order(uint32_t order) {
+  if (order > PHYS_BUDDY_MAX_ORDER) {
+    return 0;
+  }
 
-  for (uint32_t i = 0; i < count; i++) map_unset(block + i);
+  // Split the smallest free buddy that is large enough
+  for (uint32_t buddy_order = order; buddy_order <= PHYS_BUDDY_MAX_ORDER;
+       buddy_order++) {
+    int32_t block = buddy_find(buddy_order);
+    if (block == -1) {
+      continue;
+    }
 
-  used_blocks_ -= count;
+    buddy_split(block, buddy_order, order);
+    map_set_range(block, 1 << order);
+    reset_pages(block, 1 << order, 1);
+    used_blocks_ += 1 << order;
+    return block * PHYS_BLOCK_SIZE;
+  }
+  return 0;
 }
 
-// Internal functions to allocate ranges of memory
-
-void allocate_chunk(int base_addr, int length) {
-  int cur_block_addr = base_addr / PHYS_BLOCK_SIZE;
-  int num_blocks = length / PHYS_BLOCK_SIZE;
-  while (num_blocks-- >= 0) {
-    map_set(cur_block_addr++);
-    used_blocks_--;
+void free_blocks(physical_addr addr, uint32_t count) {
+  uint32_t block = addr / PHYS_BLOCK_SIZE;
+  if (block >= total_blocks_) {
+    return;
+  }
+  uint32_t end = total_blocks_ - block < count ? total_blocks_
+                                                : block + count;
+
+  // Only hand back the runs that are actually allocated, so freeing a block
+  // twice can't put it in the buddy maps twice
+  uint32_t run_start = bitmap_find_next_set(phys_memory_map_, end, block);
+  while (run_start < end) {
+    uint32_t run_end = bitmap_find_next_unset(phys_memory_map_, end,
+                                              run_start);
+    map_unset_range(run_start, run_end - run_start);
+    reset_pages(run_start, run_end - run_start, 0);
+    buddy_free_range(run_start, run_end - run_start);
+    used_blocks_ -= run_end - run_start;
+    run_start = bitmap_find_next_set(phys_memory_map_, end, run_end);
   }
 }
 
-void free_chunk(int base_addr, int length) {
-  int cur_block_addr = base_addr / PHYS_BLOCK_SIZE;
-  int num_blocks = length / PHYS_BLOCK_SIZE;
+// Internal functions to allocate ranges of memory. These only touch the
+// bitmap, the summary and buddy maps are built from it once it is complete.
+
+void allocate_chunk(uint32_t base_addr, uint32_t length) {
+  uint32_t cur_block = base_addr / PHYS_BLOCK_SIZE;
+  uint32_t end_block = (base_addr + length + PHYS_BLOCK_SIZE - 1)
+                       / PHYS_BLOCK_SIZE;
+  for (; cur_block < end_block && cur_block < total_blocks_; cur_block++) {
+    if (!bitmap_test(phys_memory_map_, cur_block)) {
+      bitmap_set(phys_memory_map_, cur_block);
+      used_blocks_++;
+    }
+  }
+}
 
-  while (num_blocks--) {
-    map_unset(cur_block_addr++);
-    used_blocks_--;
+void free_chunk(uint32_t base_addr, uint32_t length) {
+  // Only blocks entirely inside the chunk can be used
+  uint32_t cur_block = (base_addr + PHYS_BLOCK_SIZE - 1) / PHYS_BLOCK_SIZE;
+  uint32_t end_block = ((uint64_t) base_addr + length) / PHYS_BLOCK_SIZE;
+  for (; cur_block < end_block && cur_block < total_blocks_; cur_block++) {
+    if (bitmap_test(phys_memory_map_, cur_block)) {
+      bitmap_unset(phys_memory_map_, cur_block);
+      used_blocks_--;
+    }
   }
 }
 
@@ -146,13 +401,53 @@ void free_chunk(int base_addr, int length) {
 void free_available_memory(struct multiboot_info* mb) {
   multiboot_memory_map_t* mm = (multiboot_memory_map_t*)mb->mmap_addr;
   while ((unsigned int)mm < mb->mmap_addr + mb->mmap_length) {
-    if (mm->type == MULTIBOOT_MEMORY_AVAILABLE) {
-      free_chunk(mm->addr, mm->len);
+    // Memory past 4GB can't be addressed without PAE
+    if (mm->type == MULTIBOOT_MEMORY_AVAILABLE && mm->addr < 0x100000000ULL) {
+      uint64_t len = mm->len;
+      if (mm->addr + len > 0x100000000ULL) {
+        len = 0x100000000ULL - mm->addr;
+      }
+      free_chunk(mm->addr, len);
     }
     mm = (multiboot_memory_map_t*)((unsigned int)mm + mm->size +
                                    sizeof(mm->size));
   }
-  map_set(0);
+  allocate_chunk(0, PHYS_BLOCK_SIZE);
+}
+
+// Builds the summary of the bitmap, hands every block left free in it to
+// the buddy allocator and marks the used ones as reserved
+void build_phys_maps() {
+  uint32_t num_words = BITMAP_WORDS_NEED_FOR_N_BITS(total_blocks_);
+  memset(phys_memory_summary_, 0x0,
+         BITMAP_WORDS_NEED_FOR_N_BITS(num_words) * sizeof(uint32_t));
+  phys_memory_cursor_ = num_words;
+  map_update_summary(0, total_blocks_);
+
+  for (uint32_t order = 0; order <= PHYS_BUDDY_MAX_ORDER; order++) {
+    memset(phys_buddy_maps_[order], 0x0,
+           BITMAP_WORDS_NEED_FOR_N_BITS(buddy_map_bits(order))
+           * sizeof(uint32_t));
+    phys_buddy_free_count_[order] = 0;
+    phys_buddy_hint_[order] = 0;
+  }
+
+  uint32_t run_start = bitmap_find_next_unset(phys_memory_map_,
+                                              total_blocks_, 0);
+  while (run_start < total_blocks_) {
+    uint32_t run_end = bitmap_find_next_set(phys_memory_map_, total_blocks_,
+                                            run_start);
+    buddy_free_range(run_start, run_end - run_start);
+    run_start = bitmap_find_next_unset(phys_memory_map_, total_blocks_,
+                                       run_end);
+  }
+
+  for (uint32_t block = 0; block < total_blocks_; block++) {
+    bool is_used = bitmap_test(phys_memory_map_, block);
+    phys_pages_[block].refcount = is_used;
+    phys_pages_[block].mapcount = 0;
+    phys_pages_[block].flags = is_used ? PAGE_RESERVED : 0;
+  }
 }
 
 void phys_memory_init(struct multiboot_info* mb) {
@@ -160,7 +455,16 @@ void phys_memory_init(struct multiboot_info* mb) {
   total_blocks_ = (phys_mem_size_kb_ * 1024) / PHYS_BLOCK_SIZE;
   used_blocks_ = total_blocks_;
   phys_memory_map_ = (uint32_t*)KERNEL_END_PADDR;
-  memset(phys_memory_map_, 0xFF, total_blocks_ / PHYS_BLOCKS_PER_BYTE);
+  place_phys_maps();
+
+  // Only the boot identity mapping is there to write the maps through
+  uint32_t maps_end = (uint32_t)(phys_pages_ + total_blocks_);
+  if (maps_end > BOOT_IDENTITY_MAP_END - BOOT_EARLY_ALLOC_SIZE) {
+    printf("PHYS MEM MAPS END AT %x, PAST THE BOOT MAPPING\n", maps_end);
+    for (;;);
+  }
+  memset(phys_memory_map_, 0xFF,
+         BITMAP_WORDS_NEED_FOR_N_BITS(total_blocks_) * sizeof(uint32_t));
   printf("Total blocks: %ld\n", total_blocks_);
 
   // Frees memory GRUB considers available
@@ -169,13 +473,19 @@ void phys_memory_init(struct multiboot_info* mb) {
   // From the freed memory, we need to allocate the ones used by the Kernel
   allocate_chunk(KERNEL_START_PADDR, KERNEL_SIZE);
 
-  // We also need to allocate the memory used by the Physical Map itself
-  allocate_chunk(*phys_memory_map_, total_blocks_);
+  // We also need to allocate the memory used by the Physical Map itself,
+  // its summary, the buddy maps and the page descriptors, which come last
   kernel_phys_map_start = (uint32_t)phys_memory_map_;
-  kernel_phys_map_end =
-      kernel_phys_map_start + (total_blocks_ / PHYS_BLOCKS_PER_BYTE);
+  kernel_phys_map_end = (uint32_t)(phys_pages_ + total_blocks_);
+  allocate_chunk(kernel_phys_map_start,
+                 kernel_phys_map_end - kernel_phys_map_start);
+
+  build_phys_maps();
   printf("PhysMem Manager installed. Mem Map start: %lx, end: %lx\n",
          kernel_phys_map_start, kernel_phys_map_end);
 }
 
-void update_map_addr(physical_addr addr) { phys_memory_map_ = (uint32_t*)addr; }
\ No newline at end of file
+void update_map_addr(physical_addr addr) {
+  phys_memory_map_ = (uint32_t*)addr;
+  place_phys_maps();
+}
@@ -6,17 +6,17 @@
 #include <string.h>
 
 string* new_string() {
-  string* string = kcalloc(sizeof(string));
-  string->contents = kcalloc(sizeof(char) * 1);
-  return string;
+  string* str = kcalloc(sizeof(string));
+  str->contents = kcalloc(sizeof(char) * 1);
+  return str;
 }
 
 string* new_string_2(char* contents, size_t size) {
-  string* string = kcalloc(sizeof(string));
-  string->size = size;
-  string->contents = kcalloc(sizeof(char) * (size + 1));
-  memcpy(string->contents, contents, size);
-  return string;
+  string* str = kcalloc(sizeof(string));
+  str->size = size;
+  str->contents = kcalloc(sizeof(char) * (size + 1));
+  memcpy(str->contents, contents, size);
+  return str;
 }
 
 void copy_string(string* to_copy, string* output) {
@@ -25,19 +25,17 @@ void delete_vector(vector* vector) {
 }
 
 void vector_resize(vector* vector) {
-  // TODO(psamora) When kheap become better, realloc would be awesome
   uint32_t new_capacity = vector->capacity * 2;
 
-  void** new_data = kcalloc(sizeof(void*) * new_capacity);
+  // Grows in place whenever the heap has room right after the data
+  void** new_data = krealloc(vector->data, sizeof(void*) * new_capacity);
   if (new_data == NULL) {
     // error;
+    return;
   }
 
-  for (size_t i = 0; i < vector->size; i++) {
-    new_data[i] = vector->data[i];
-  }
-
-  kfree(vector->data);
+  memset(&new_data[vector->capacity], 0x0,
+         sizeof(void*) * (new_capacity - vector->capacity));
   vector->capacity = new_capacity;
   vector->data = new_data;
 }
\ No newline at end of file
@@ -1,128 +1,740 @@
+#include <libk/heap.h>
 #include <libk/paging.h>
 #include <libk/phys_mem.h>
 #include <libk/virt_mem.h>
+#include <libk/vmem.h>
 #include <stdio.h>
 #include <string.h>
 
-bool alloc_page(virtual_addr vaddr) {
-  physical_addr paddr = alloc_block();
-  if (!paddr) {
+// Range populated on demand by the page fault handler
+static virtual_addr reserved_start_ = 0;
+static virtual_addr reserved_end_ = 0;
+
+// Zeroed blocks, a stack so taking one is a single pop
+static physical_addr zero_pool_[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count_ = 0;
+
+// Read only block of zeroes, shared copy on write by lazy mappings. It keeps
+// an extra reference, so it is never freed or written in place.
+static physical_addr zero_page_ = 0;
+
+// Returns a block from the zero pool, or 0 if it is empty
+static physical_addr pop_zeroed_block() {
+  if (zero_pool_count_ == 0) return 0;
+  return zero_pool_[--zero_pool_count_];
+}
+
+// The address space set up at boot, which owns the kernel directory
+static address_space kernel_space_;
+static address_space* current_space_ = &kernel_space_;
+
+// Kernel half entries that live in the kernel directory, the same in every
+// address space. The window entries after them are per directory.
+inline static bool is_kernel_entry(virtual_addr vaddr) {
+  return vaddr >= KERNEL_VIRT_BASE && vaddr < FOREIGN_TABLES_VIRT_ADDR;
+}
+
+// Returns the directory entry of vaddr in the current directory, first
+// copying it from the kernel directory if it is a kernel entry created
+// since this directory was. Not present entries are never cached by the
+// TLB, so there is nothing to flush.
+static pd_entry* lookup_directory_entry(virtual_addr vaddr) {
+  pd_entry* entry = pdirectory_lookup_entry(current_directory(), vaddr);
+  if (!pd_entry_is_present(*entry) && is_kernel_entry(vaddr)) {
+    *entry = *pdirectory_lookup_entry(kernel_directory(), vaddr);
+  }
+  return entry;
+}
+
+// Returns the page table entry of vaddr, allocating its page table if it
+// isn't present. Returns NULL if vaddr is mapped by a 4MB page or the table
+// can't be allocated.
+static pt_entry* get_page_entry(virtual_addr vaddr) {
+  pd_entry* entry = lookup_directory_entry(vaddr);
+  page_table* table = current_table(vaddr);
+  if (pd_entry_is_4mb(*entry)) {
+    // Already mapped by a 4MB page, which has no page table to update
+    printf("ALREADY MAPPED BY A 4MB PAGE\n");
+    return NULL;
+  }
+  if (!pd_entry_is_present(*entry)) {
+    // Page Directory Entry not present, allocate it
+    physical_addr table_block = pop_zeroed_block();
+    bool zeroed = table_block != 0;
+    if (!zeroed) {
+      table_block = alloc_block();
+    }
+    if (!table_block) return NULL;
+
+    // Maps the Page Directory Entry to the new table, which makes it show up
+    // in the page table window. Not present entries are never cached by the
+    // TLB, so there is nothing to flush.
+    pd_entry_add_attrib(entry, I86_PDE_PRESENT);
+    pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
+    pd_entry_set_frame(entry, table_block);
+
+    // Clear the newly allocated page
+    if (!zeroed) {
+      memset(table, 0, sizeof(page_table));
+    }
+
+    // Other address spaces find kernel tables in the kernel directory
+    if (is_kernel_entry(vaddr)) {
+      *pdirectory_lookup_entry(kernel_directory(), vaddr) = *entry;
+    }
+  }
+  return ptable_lookup_entry(table, vaddr);
+}
+
+// Points the entry of vaddr at paddr with the given I86_PTE_* attributes.
+// Returns true if it replaced a present mapping, which the TLB may still
+// hold.
+static bool set_page_entry(pt_entry* page,
+                           physical_addr paddr,
+                           virtual_addr vaddr,
+                           uint32_t attribs) {
+  // Keep track of how many times each block is mapped
+  bool was_present = pt_entry_is_present(*page);
+  if (was_present) {
+    page_t* old_page = block_to_page(pt_entry_frame(*page));
+    if (old_page && old_page->mapcount > 0) {
+      old_page->mapcount--;
+    }
+  }
+  page_t* new_page = block_to_page(paddr);
+  if (new_page) {
+    new_page->mapcount++;
+  }
+
+  // Maps the Page Table Entry to the given physical address
+  *page = 0;
+  pt_entry_set_frame(page, paddr);
+  pt_entry_add_attrib(page, I86_PTE_PRESENT);
+  pt_entry_add_attrib(page, attribs);
+#if KERNEL_GLOBAL_PAGES
+  // The kernel half is the same in every address space
+  if (vaddr >= KERNEL_VIRT_BASE) {
+    pt_entry_enable_global(page);
+  }
+#endif
+  return was_present;
+}
+
+// Clears a present page table entry, dropping the reference the mapping
+// held on its block, which frees it if it was the last one
+static void release_page_entry(pt_entry* entry) {
+  physical_addr block = pt_entry_frame(*entry);
+  page_t* page = block_to_page(block);
+  if (page && page->mapcount > 0) {
+    page->mapcount--;
+  }
+  if (block) {
+    put_block(block);
+  }
+
+  pt_entry_del_attrib(entry, I86_PTE_PRESENT);
+}
+
+// Unmaps vaddr, dropping the reference its mapping held on the block.
+// Returns true if it was mapped, so its TLB entry has to be flushed.
+static bool clear_page_entry(virtual_addr vaddr) {
+  pd_entry* pd_entry = lookup_directory_entry(vaddr);
+  if (!pd_entry_is_present(*pd_entry)) return false;
+  if (pd_entry_is_4mb(*pd_entry)) return false;
+
+  pt_entry* pt_entry = ptable_lookup_entry(current_table(vaddr), vaddr);
+  if (pt_entry_is_guard(*pt_entry)) {
+    *pt_entry = 0;
     return false;
   }
-  map_page(paddr, vaddr);
+  if (!pt_entry_is_present(*pt_entry)) return false;
+
+  release_page_entry(pt_entry);
+  return true;
+}
+
+// Returns the entry of vaddr if it is a guard page, or NULL
+static pt_entry* lookup_guard_entry(virtual_addr vaddr) {
+  pd_entry* pd_entry = lookup_directory_entry(vaddr);
+  if (!pd_entry_is_present(*pd_entry) || pd_entry_is_4mb(*pd_entry)) {
+    return NULL;
+  }
+  pt_entry* pt_entry = ptable_lookup_entry(current_table(vaddr), vaddr);
+  return pt_entry_is_guard(*pt_entry) ? pt_entry : NULL;
+}
+
+void flush_tlb_all() {
+  // Reloading CR3 keeps global entries, toggling CR4.PGE drops them too
+  uint32_t cr4 = read_cr4();
+  if (cr4 & CR4_PGE) {
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else {
+    write_cr3(read_cr3());
+  }
+}
+
+void flush_tlb_range(virtual_addr addr, uint32_t count) {
+  if (count > TLB_FLUSH_ALL_THRESHOLD) {
+    flush_tlb_all();
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    flush_tlb_entry(addr + i * PAGE_SIZE);
+  }
+}
+
+bool alloc_range(virtual_addr vaddr, uint32_t count) {
+  bool flush = false;
+  for (uint32_t i = 0; i < count; i++) {
+    virtual_addr page_addr = vaddr + i * PAGE_SIZE;
+    physical_addr paddr = alloc_block();
+    pt_entry* page = paddr ? get_page_entry(page_addr) : NULL;
+    if (!page) {
+      // Give back what we mapped so far
+      if (paddr) {
+        free_block(paddr);
+      }
+      unmap_range(vaddr, i);
+      return false;
+    }
+    flush |= set_page_entry(page, paddr, page_addr, I86_PTE_WRITABLE);
+  }
+
+  if (flush) {
+    flush_tlb_range(vaddr, count);
+  }
   return true;
 }
 
+// Maps count contiguous blocks starting at paddr with the given I86_PTE_*
+// attributes, see map_range
+static bool map_range_attribs(physical_addr paddr,
+                              virtual_addr vaddr,
+                              uint32_t count,
+                              uint32_t attribs) {
+  bool flush = false;
+  for (uint32_t i = 0; i < count; i++) {
+    virtual_addr page_addr = vaddr + i * PAGE_SIZE;
+    pt_entry* page = get_page_entry(page_addr);
+    if (!page) {
+      // Unmap what we mapped so far. The references the caller handed over
+      // with the blocks are given back first, so unmapping doesn't drop them.
+      for (uint32_t j = 0; j < i; j++) {
+        get_block(paddr + j * PAGE_SIZE);
+      }
+      unmap_range(vaddr, i);
+      return false;
+    }
+    flush |= set_page_entry(page, paddr + i * PAGE_SIZE, page_addr, attribs);
+  }
+
+  if (flush) {
+    flush_tlb_range(vaddr, count);
+  }
+  return true;
+}
+
+bool map_range(physical_addr paddr, virtual_addr vaddr, uint32_t count) {
+  return map_range_attribs(paddr, vaddr, count, I86_PTE_WRITABLE);
+}
+
+bool map_device_range(physical_addr paddr,
+                      virtual_addr vaddr,
+                      uint32_t count) {
+  return map_range_attribs(paddr, vaddr, count,
+                           I86_PTE_WRITABLE | I86_PTE_NOT_CACHEABLE
+                           | I86_PTE_WRITETHOUGH);
+}
+
+void unmap_range(virtual_addr vaddr, uint32_t count) {
+  bool flush = false;
+  for (uint32_t i = 0; i < count; i++) {
+    flush |= clear_page_entry(vaddr + i * PAGE_SIZE);
+  }
+
+  if (flush) {
+    flush_tlb_range(vaddr, count);
+  }
+}
+
+bool alloc_page(virtual_addr vaddr) {
+  return alloc_range(vaddr, 1);
+}
+
 void free_page(virtual_addr addr) {
-  pd_entry* pd_entry = pdirectory_lookup_entry(cur_directory, addr);
-  if (!pd_entry) return;
+  unmap_range(addr, 1);
+}
 
-  page_table* table = (page_table*)PAGE_GET_PHYSICAL_ADDRESS(pd_entry);
-  pt_entry* pt_entry = ptable_lookup_entry(table, addr);
-  if (!pt_entry) return;
+bool map_page(physical_addr paddr, virtual_addr vaddr) {
+  return map_range(paddr, vaddr, 1);
+}
 
-  physical_addr block = pt_entry_frame(*pt_entry);
-  if (block) {
+bool map_guard_page(virtual_addr addr, virtual_addr owner) {
+  unmap_range(addr, 1);
+  pt_entry* entry = get_page_entry(addr);
+  if (!entry) return false;
+  pt_entry_set_guard(entry, owner);
+  return true;
+}
+
+bool is_guard_page(virtual_addr addr) {
+  return lookup_guard_entry(addr) != NULL;
+}
+
+void reserve_range(virtual_addr start, virtual_addr end) {
+  reserved_start_ = start;
+  reserved_end_ = end;
+}
+
+// Maps block at SCRATCH_VIRT_ADDR without taking a reference on it, so
+// blocks that aren't mapped anywhere can be filled
+static void* map_scratch(physical_addr block) {
+  pt_entry* entry = get_page_entry(SCRATCH_VIRT_ADDR);
+  if (!entry) return NULL;
+  *entry = 0;
+  pt_entry_add_attrib(entry, I86_PTE_PRESENT);
+  pt_entry_add_attrib(entry, I86_PTE_WRITABLE);
+  pt_entry_set_frame(entry, block);
+  flush_tlb_entry(SCRATCH_VIRT_ADDR);
+  return (void*)SCRATCH_VIRT_ADDR;
+}
+
+static void unmap_scratch() {
+  page_table* table = current_table(SCRATCH_VIRT_ADDR);
+  *ptable_lookup_entry(table, SCRATCH_VIRT_ADDR) = 0;
+  flush_tlb_entry(SCRATCH_VIRT_ADDR);
+}
+
+static bool zero_block(physical_addr block) {
+  void* scratch = map_scratch(block);
+  if (!scratch) return false;
+  memset(scratch, 0, PAGE_SIZE);
+  unmap_scratch();
+  return true;
+}
+
+physical_addr alloc_zeroed_block() {
+  physical_addr block = pop_zeroed_block();
+  if (block) return block;
+
+  block = alloc_block();
+  if (block && !zero_block(block)) {
     free_block(block);
+    return 0;
   }
+  return block;
+}
+
+bool refill_zero_pool() {
+  if (zero_pool_count_ == ZERO_POOL_SIZE) return false;
 
-  pt_entry_del_attrib(pt_entry, I86_PTE_PRESENT);
+  physical_addr block = alloc_block();
+  bool zeroed = block && zero_block(block);
+  if (zeroed) {
+    zero_pool_[zero_pool_count_++] = block;
+  } else if (block) {
+    free_block(block);
+  }
+  return zeroed;
 }
 
-void map_page(physical_addr paddr, virtual_addr vaddr) {
-  pd_entry* entry = pdirectory_lookup_entry(cur_directory, vaddr);
-  if (!pd_entry_is_present(*entry)) {
-    // Page Directory Entry not present, allocate it
-    physical_addr table = alloc_block();
-    if (!table) return;
+// Returns a new block with a copy of the page at page_addr, or 0 if out of
+// memory
+static physical_addr copy_page(virtual_addr page_addr) {
+  physical_addr copy = alloc_block();
+  void* scratch = copy ? map_scratch(copy) : NULL;
+  if (!scratch) {
+    if (copy) {
+      free_block(copy);
+    }
+    return 0;
+  }
+  memcpy(scratch, (void*)page_addr, PAGE_SIZE);
+  unmap_scratch();
+  return copy;
+}
 
-    // Temporarily maps the new Page Table to the temporary table addr
-    map_page(table, (virtual_addr)TEMPORARY_TABLE_ADDR);
-    invlpg(TEMPORARY_TABLE_ADDR);
+// Attributes of entry to carry over to a new mapping of its page. The
+// accessed and dirty bits belong to the old mapping, so they are dropped.
+inline static uint32_t pt_entry_attribs(pt_entry entry) {
+  return entry & ~(I86_PTE_FRAME | I86_PTE_PRESENT | I86_PTE_ACCESSED
+                   | I86_PTE_DIRTY);
+}
 
-    // Clear the newly allocated page
-    memset(TEMPORARY_TABLE_ADDR, 0, sizeof(page_table));
+// Gives the copy on write page holding addr a block of its own, or makes it
+// writable if nobody else shares its block anymore. Returns false if addr
+// isn't copy on write or out of memory.
+static bool copy_on_write(virtual_addr addr) {
+  virtual_addr page_addr = addr & ~(PAGE_SIZE - 1);
+  pd_entry* pd_entry = lookup_directory_entry(page_addr);
+  if (!pd_entry_is_present(*pd_entry) || pd_entry_is_4mb(*pd_entry)) {
+    return false;
+  }
+  pt_entry* entry = ptable_lookup_entry(current_table(page_addr), page_addr);
+  if (!pt_entry_is_present(*entry) || !pt_entry_is_cow(*entry)) {
+    return false;
+  }
 
-    // Maps the Page Directory Entry to the new table
-    pd_entry_add_attrib(entry, I86_PDE_PRESENT);
-    pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
-    pd_entry_set_frame(entry, table);
+  physical_addr block = pt_entry_frame(*entry);
+  page_t* page = block_to_page(block);
+  if (page && page->refcount > 1) {
+    // Copies of the zero page only need to be zeroed
+    physical_addr copy = block == zero_page_ ? alloc_zeroed_block()
+                                             : copy_page(page_addr);
+    if (!copy) return false;
+
+    // The new mapping holds the reference alloc_block gave us. It keeps the
+    // attributes of the shared one, USER included.
+    uint32_t attribs = pt_entry_attribs(*entry) & ~I86_PTE_COPY_ON_WRITE;
+    set_page_entry(entry, copy, page_addr, attribs | I86_PTE_WRITABLE);
+    put_block(block);
+  } else {
+    pt_entry_del_attrib(entry, I86_PTE_COPY_ON_WRITE);
+    pt_entry_add_attrib(entry, I86_PTE_WRITABLE);
+  }
+  flush_tlb_entry(page_addr);
+  return true;
+}
+
+// Backs a page of a reserved range on its first access. Reads share the
+// zero page until they write, writes get a zeroed block right away.
+static bool map_lazy_page(virtual_addr page_addr, bool write) {
+  pt_entry* entry = get_page_entry(page_addr);
+  if (!entry) return false;
+
+  if (write) {
+    physical_addr block = alloc_zeroed_block();
+    if (!block) return false;
+    set_page_entry(entry, block, page_addr, I86_PTE_WRITABLE);
+  } else {
+    get_block(zero_page_);
+    set_page_entry(entry, zero_page_, page_addr, I86_PTE_COPY_ON_WRITE);
   }
+  return true;
+}
 
-  // Get table address from entry, guaranteed to be set now
-  page_table* table = (page_table*)PAGE_GET_TABLE_ADDRESS(entry);
+void page_fault_handler(struct regs* r) {
+  virtual_addr addr = read_cr2();
 
-  // Get page table entry
-  pt_entry* page = ptable_lookup_entry(table, vaddr);
+  // Kernel tables created in another address space only need their
+  // directory entry copied over
+  pd_entry* entry = pdirectory_lookup_entry(current_directory(), addr);
+  if (!pd_entry_is_present(*entry)
+      && pd_entry_is_present(*lookup_directory_entry(addr))) {
+    return;
+  }
 
-  // Maps the Page Table Entry to the given physical address
-  pt_entry_set_frame(page, paddr);
-  pt_entry_add_attrib(page, I86_PTE_PRESENT);
-  pt_entry_add_attrib(page, I86_PTE_WRITABLE);
-  flush_tlb_entry(vaddr);
+  // Writes to copy on write pages
+  if (r->err_code & PAGE_FAULT_PROTECTION && r->err_code & PAGE_FAULT_WRITE
+      && copy_on_write(addr)) {
+    return;
+  }
+
+  pt_entry* guard = lookup_guard_entry(addr);
+  if (guard) {
+    printf("GUARD PAGE HIT AT %x, EIP %x\n", addr, r->eip);
+    heap_report_guard_fault(pt_entry_guard_owner(*guard));
+    for (;;);
+  }
+
+  // Only pages vmem handed out are backed, so stray pointers and uses after
+  // vmem_free still fault
+  if (r->err_code & PAGE_FAULT_PROTECTION
+      || addr < reserved_start_ || addr >= reserved_end_
+      || !vmem_is_alloced(addr)) {
+    printf("PAGE FAULT AT %x, ERROR %x, EIP %x\n", addr, r->err_code,
+           r->eip);
+    for (;;);
+  }
+
+  if (!map_lazy_page(addr & ~(PAGE_SIZE - 1),
+                     r->err_code & PAGE_FAULT_WRITE)) {
+    printf("OUT OF MEMORY, PAGE FAULT AT %x\n", addr);
+    for (;;);
+  }
 }
 
 uint32_t virt_to_phys(virtual_addr addr) {
-  pd_entry* pd_entry = pdirectory_lookup_entry(cur_directory, addr);
-  if (!pd_entry) return -1;
-  page_table* table = (page_table*)PAGE_GET_TABLE_ADDRESS(pd_entry);
-  pt_entry* pt_entry = ptable_lookup_entry(table, addr);
-  return PAGE_GET_PHYSICAL_ADDRESS(pt_entry);
+  pd_entry* pd_entry = lookup_directory_entry(addr);
+  if (!pd_entry_is_present(*pd_entry)) return -1;
+  if (pd_entry_is_4mb(*pd_entry)) {
+    return pd_entry_frame(*pd_entry) | (addr & (LARGE_PAGE_SIZE - 1));
+  }
+
+  // The page table window is a flat array of the entries of every page
+  pt_entry* entry = (pt_entry*)PAGE_TABLES_VIRT_ADDR + (addr >> 12);
+  return PAGE_GET_PHYSICAL_ADDRESS(entry) | (addr & 0xFFF);
+}
+
+// Points the foreign entry of the current directory at another directory,
+// which then shows up at FOREIGN_DIRECTORY_VIRT_ADDR and its page tables in
+// the window at FOREIGN_TABLES_VIRT_ADDR, so it can be edited without
+// switching to it
+static page_directory* map_foreign_directory(physical_addr directory) {
+  pd_entry* entry = &current_directory()->m_entries[FOREIGN_DIRECTORY_INDEX];
+  *entry = 0;
+  pd_entry_add_attrib(entry, I86_PDE_PRESENT);
+  pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
+  pd_entry_set_frame(entry, directory);
+
+  // The window may still hold entries of the last foreign directory. The
+  // only global ones in it are kernel entries, the same in every directory,
+  // so reloading CR3 is enough.
+  write_cr3(read_cr3());
+  return (page_directory*)FOREIGN_DIRECTORY_VIRT_ADDR;
+}
+
+static void unmap_foreign_directory() {
+  current_directory()->m_entries[FOREIGN_DIRECTORY_INDEX] = 0;
+  write_cr3(read_cr3());
+}
+
+// Entries every address space takes from the kernel directory: the
+// identity mapped first 4MB and the kernel half up to the foreign entry
+inline static bool is_shared_entry(uint32_t index) {
+  return index < PAGE_DIRECTORY_INDEX(USER_VIRT_ADDR_START)
+         || (index >= PAGE_DIRECTORY_INDEX(KERNEL_VIRT_BASE)
+             && index < FOREIGN_DIRECTORY_INDEX);
+}
+
+address_space* create_address_space() {
+  address_space* space = kmalloc(sizeof(address_space));
+  if (!space) return NULL;
+  space->directory = alloc_block();
+  if (!space->directory) {
+    kfree(space);
+    return NULL;
+  }
+
+  // Shares the kernel page tables instead of copying them, so this costs
+  // the same no matter how much the kernel has mapped
+  page_directory* directory = map_foreign_directory(space->directory);
+  page_directory* kernel = kernel_directory();
+  for (uint32_t i = 0; i < PAGES_PER_DIR; i++) {
+    directory->m_entries[i] = is_shared_entry(i) ? kernel->m_entries[i] : 0;
+  }
+
+  pd_entry* self_entry = &directory->m_entries[PAGE_DIRECTORY_SELF_INDEX];
+  pd_entry_add_attrib(self_entry, I86_PDE_PRESENT);
+  pd_entry_add_attrib(self_entry, I86_PDE_WRITABLE);
+  pd_entry_set_frame(self_entry, space->directory);
+  unmap_foreign_directory();
+  return space;
+}
+
+void destroy_address_space(address_space* space) {
+  if (space == &kernel_space_ || space == current_space_) {
+    printf("CAN'T DESTROY THE CURRENT ADDRESS SPACE\n");
+    // abort
+    return;
+  }
+
+  // Only the user half is owned by the space, so this costs as much as
+  // what it has mapped
+  page_directory* directory = map_foreign_directory(space->directory);
+  for (uint32_t i = PAGE_DIRECTORY_INDEX(USER_VIRT_ADDR_START);
+       i < PAGE_DIRECTORY_INDEX(USER_VIRT_ADDR_END); i++) {
+    pd_entry entry = directory->m_entries[i];
+    if (!pd_entry_is_present(entry) || pd_entry_is_4mb(entry)) continue;
+
+    page_table* table =
+        (page_table*)(FOREIGN_TABLES_VIRT_ADDR + i * PAGE_SIZE);
+    for (uint32_t j = 0; j < PAGES_PER_TABLE; j++) {
+      if (pt_entry_is_present(table->m_entries[j])) {
+        release_page_entry(&table->m_entries[j]);
+      }
+    }
+    free_block(pd_entry_frame(entry));
+  }
+  unmap_foreign_directory();
+
+  free_block(space->directory);
+  kfree(space);
 }
 
+void switch_address_space(address_space* space) {
+  current_space_ = space;
+  cur_directory = (page_directory*)space->directory;
+  write_cr3(space->directory);
+}
+
+address_space* current_address_space() {
+  return current_space_;
+}
+
+bool copy_range_cow(address_space* dest, virtual_addr addr, uint32_t count) {
+  if (addr < USER_VIRT_ADDR_START || addr >= USER_VIRT_ADDR_END
+      || count > (USER_VIRT_ADDR_END - addr) / PAGE_SIZE) {
+    printf("NOT A USER RANGE\n");
+    // abort
+    return false;
+  }
+
+  bool result = true;
+  page_directory* directory = map_foreign_directory(dest->directory);
+  for (uint32_t i = 0; i < count; i++) {
+    virtual_addr page_addr = addr + i * PAGE_SIZE;
+    pd_entry* table_entry = lookup_directory_entry(page_addr);
+    if (!pd_entry_is_present(*table_entry)) {
+      // Skip the rest of the table
+      i += PAGES_PER_TABLE - 1 - PAGE_TABLE_INDEX(page_addr);
+      continue;
+    }
+    if (pd_entry_is_4mb(*table_entry)) continue;
+
+    pt_entry* entry = ptable_lookup_entry(current_table(page_addr), page_addr);
+    if (!pt_entry_is_present(*entry)) continue;
+    if (pt_entry_is_writable(*entry)) {
+      pt_entry_enable_cow(entry);
+    }
+
+    // Allocates the table of dest if needed, through the foreign window
+    uint32_t index = PAGE_DIRECTORY_INDEX(page_addr);
+    pd_entry* dest_entry = &directory->m_entries[index];
+    page_table* dest_table =
+        (page_table*)(FOREIGN_TABLES_VIRT_ADDR + index * PAGE_SIZE);
+    if (!pd_entry_is_present(*dest_entry)) {
+      physical_addr table_block = alloc_block();
+      if (!table_block) {
+        result = false;
+        break;
+      }
+      pd_entry_add_attrib(dest_entry, I86_PDE_PRESENT);
+      pd_entry_add_attrib(dest_entry, I86_PDE_WRITABLE);
+      pd_entry_add_attrib(dest_entry, I86_PDE_USER);
+      pd_entry_set_frame(dest_entry, table_block);
+      memset(dest_table, 0, sizeof(page_table));
+    }
+
+    // Whatever dest mapped there is replaced. dest isn't loaded, so the TLB
+    // doesn't hold it.
+    pt_entry* dest_page = ptable_lookup_entry(dest_table, page_addr);
+    if (pt_entry_is_present(*dest_page)) {
+      release_page_entry(dest_page);
+    }
+
+    // Both mappings hold a reference to the block
+    physical_addr block = pt_entry_frame(*entry);
+    get_block(block);
+    set_page_entry(dest_page, block, page_addr, pt_entry_attribs(*entry));
+  }
+  unmap_foreign_directory();
+
+  // Pages that turned read only may still be writable in the TLB
+  flush_tlb_range(addr, count);
+  return result;
+}
+
+// Maps the physical memory holding the kernel and the PMM maps at
+// KERNEL_VIRT_BASE. With KERNEL_LARGE_PAGES, every 4MB chunk up to
+// KERNEL_DIRECT_MAP_END gets a single 4MB directory entry, otherwise they
+// get a page table of 4KB pages. With KERNEL_GLOBAL_PAGES, they are global.
+void map_kernel_direct_map() {
+  for (uint32_t chunk = 0; chunk < KERNEL_PHYS_MAP_END;
+       chunk += LARGE_PAGE_SIZE) {
+    virtual_addr virt = KERNEL_VIRT_BASE + chunk;
+    pd_entry* entry = pdirectory_lookup_entry(cur_directory, virt);
+    pd_entry_add_attrib(entry, I86_PDE_PRESENT);
+    pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
+
+#if KERNEL_LARGE_PAGES
+    pd_entry_add_attrib(entry, I86_PDE_4MB);
+#if KERNEL_GLOBAL_PAGES
+    pd_entry_enable_global(entry);
+#endif
+    pd_entry_set_frame(entry, chunk);
+#else
+    page_table* table = (page_table*)alloc_block();
+    if (!table) return;
+    memset(table, 0, sizeof(page_table));
+
+    for (uint32_t frame = chunk;
+         frame < chunk + LARGE_PAGE_SIZE && frame < KERNEL_PHYS_MAP_END;
+         frame += PAGE_SIZE) {
+      pt_entry page = 0;
+      pt_entry_add_attrib(&page, I86_PTE_PRESENT);
+      pt_entry_add_attrib(&page, I86_PTE_WRITABLE);
+#if KERNEL_GLOBAL_PAGES
+      pt_entry_enable_global(&page);
+#endif
+      pt_entry_set_frame(&page, frame);
+
+      table->m_entries[PAGE_TABLE_INDEX(KERNEL_VIRT_BASE + frame)] = page;
+    }
+    pd_entry_set_frame(entry, (physical_addr)table);
+#endif
+  }
+}
+
+#if KERNEL_GLOBAL_PAGES
+static bool cpu_has_global_pages() {
+  uint32_t regs[4];
+  cpuid(1, regs);
+  return regs[3] & CPUID_EDX_PGE;
+}
+#endif
+
 void virt_memory_init() {
+  // Create default directory table
+  cur_directory = (page_directory*)alloc_blocks(3);
+  if (!cur_directory) return;
+
+  memset(cur_directory, 0, sizeof(page_directory));
+
   // Allocates first MB page table
   page_table* table = (page_table*)alloc_block();
   if (!table) return;
 
-  // Allocates kernel page table
-  page_table* table2 = (page_table*)alloc_block();
-  if (!table2) return;
-
-  // Clear allocated page tables
+  // Clear allocated page table
   memset(table, 0, sizeof(page_table));
-  memset(table2, 0, sizeof(page_table));
 
   // Maps first MB to 3GB
   for (int frame = 0x0, virt = 0xC0000000; frame < 0x100000;
        frame += 4096, virt += 4096) {
     pt_entry page = 0;
     pt_entry_add_attrib(&page, I86_PTE_PRESENT);
+    pt_entry_add_attrib(&page, I86_PTE_WRITABLE);
     pt_entry_set_frame(&page, frame);
 
     table->m_entries[PAGE_TABLE_INDEX(virt)] = page;
   }
 
-  // Maps kernel pages and phys mem pages
-  // TODO(psamora) What if kernel is > 4MB?
-  for (uint32_t frame = KERNEL_START_PADDR, virt = KERNEL_START_VADDR;
-       frame < KERNEL_PHYS_MAP_END; frame += 4096, virt += 4096) {
-    pt_entry page = 0;
-    pt_entry_add_attrib(&page, I86_PTE_PRESENT);
-    pt_entry_set_frame(&page, frame);
-
-    table2->m_entries[PAGE_TABLE_INDEX(virt)] = page;
-  }
-
-  // Create default directory table
-  cur_directory = (page_directory*)alloc_blocks(3);
-  if (!cur_directory) return;
-
-  memset(cur_directory, 0, sizeof(page_directory));
-
   pd_entry* entry = pdirectory_lookup_entry(cur_directory, 0x00000000);
   pd_entry_add_attrib(entry, I86_PDE_PRESENT);
   pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
   pd_entry_set_frame(entry, (physical_addr)table);
 
-  pd_entry* entry2 = pdirectory_lookup_entry(cur_directory, 0xC0100000);
-  pd_entry_add_attrib(entry2, I86_PDE_PRESENT);
-  pd_entry_add_attrib(entry2, I86_PDE_WRITABLE);
-  pd_entry_set_frame(entry2, (physical_addr)table2);
+  // Maps kernel pages and phys mem pages
+  map_kernel_direct_map();
+
+  // Maps the directory into itself, so page tables are reachable once
+  // paging is enabled
+  pd_entry* self_entry = &cur_directory->m_entries[PAGE_DIRECTORY_SELF_INDEX];
+  pd_entry_add_attrib(self_entry, I86_PDE_PRESENT);
+  pd_entry_add_attrib(self_entry, I86_PDE_WRITABLE);
+  pd_entry_set_frame(self_entry, (physical_addr)cur_directory);
 
+  // This is the kernel directory, which every address space maps the same
+  pd_entry* kernel_entry = &cur_directory->m_entries[KERNEL_DIRECTORY_INDEX];
+  pd_entry_add_attrib(kernel_entry, I86_PDE_PRESENT);
+  pd_entry_add_attrib(kernel_entry, I86_PDE_WRITABLE);
+  pd_entry_set_frame(kernel_entry, (physical_addr)cur_directory);
+  kernel_space_.directory = (physical_addr)cur_directory;
+
+#if KERNEL_GLOBAL_PAGES
+  // Kernel mappings are marked global either way, CPUs without CR4.PGE
+  // ignore the bit
+  if (cpu_has_global_pages()) {
+    write_cr4(read_cr4() | CR4_PGE);
+  }
+#endif
   enable_paging((uint32_t)cur_directory);
+  register_interrupt_handler(PAGE_FAULT_IDT_INDEX, page_fault_handler);
 
   // Updates the Phys Mem table to its new virtual address
   update_map_addr(KERNEL_END_VADDR);
+
+  zero_page_ = alloc_zeroed_block();
   printf("Paging installed.\n");
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include <libk/bitmap.h>
+#include <libk/phys_mem.h>
+#include <libk/virt_mem.h>
+#include <libk/vmem.h>
+#include <stdio.h>
+#include <string.h>
+
+// Bit i is set if the page at vmem_start_ + i * PAGE_SIZE is taken. Sized
+// for the largest region, the kernel half up to VMEM_VIRT_ADDR_END.
+static uint32_t vmem_map_[BITMAP_WORDS_NEED_FOR_N_BITS(VMEM_MAX_PAGES)];
+static virtual_addr vmem_start_ = 0;
+static uint32_t vmem_pages_ = 0;
+
+// Every page before the cursor is taken, searches start at it
+static uint32_t vmem_cursor_ = 0;
+
+inline static uint32_t addr_to_page(virtual_addr addr) {
+  return (addr - vmem_start_) / PAGE_SIZE;
+}
+
+inline static virtual_addr page_to_addr(uint32_t page) {
+  return vmem_start_ + page * PAGE_SIZE;
+}
+
+// Returns true if [addr, addr + count pages) lies in the region
+static bool is_vmem_range(virtual_addr addr, uint32_t count) {
+  return addr >= vmem_start_ && addr % PAGE_SIZE == 0
+         && addr_to_page(addr) < vmem_pages_
+         && count <= vmem_pages_ - addr_to_page(addr);
+}
+
+void vmem_init() {
+  // The direct map grows with the PMM maps, so the region starts after it
+  vmem_start_ = KERNEL_DIRECT_MAP_END;
+  vmem_pages_ = (VMEM_VIRT_ADDR_END - vmem_start_) / PAGE_SIZE;
+  vmem_cursor_ = 0;
+  memset(vmem_map_, 0x0, sizeof(vmem_map_));
+  reserve_range(vmem_start_, VMEM_VIRT_ADDR_END);
+  printf("VMem installed. Start: %x, end: %x\n", vmem_start_,
+         VMEM_VIRT_ADDR_END);
+}
+
+virtual_addr vmem_alloc(uint32_t count) {
+  int32_t page = bitmap_find_unset_run(vmem_map_, vmem_pages_, vmem_cursor_,
+                                       count);
+  if (page == -1) {
+    return 0;
+  }
+
+  bitmap_set_range(vmem_map_, page, count);
+  if ((uint32_t) page == vmem_cursor_) {
+    vmem_cursor_ = bitmap_find_next_unset(vmem_map_, vmem_pages_,
+                                          page + count);
+  }
+  return page_to_addr(page);
+}
+
+bool vmem_extend(virtual_addr addr, uint32_t count, uint32_t new_count) {
+  if (new_count <= count || !is_vmem_range(addr, new_count)) {
+    return false;
+  }
+
+  uint32_t end = addr_to_page(addr) + count;
+  if (!bitmap_is_range_unset(vmem_map_, end, new_count - count)) {
+    return false;
+  }
+  bitmap_set_range(vmem_map_, end, new_count - count);
+  if (end == vmem_cursor_) {
+    vmem_cursor_ = bitmap_find_next_unset(vmem_map_, vmem_pages_,
+                                          end + new_count - count);
+  }
+  return true;
+}
+
+void vmem_free(virtual_addr addr, uint32_t count) {
+  if (!is_vmem_range(addr, count)) {
+    printf("NOT ALLOCATED VMEM %x\n", addr);
+    // abort
+    return;
+  }
+
+  unmap_range(addr, count);
+  uint32_t page = addr_to_page(addr);
+  bitmap_unset_range(vmem_map_, page, count);
+  if (page < vmem_cursor_) {
+    vmem_cursor_ = page;
+  }
+}
+
+virtual_addr vmem_map_device(physical_addr paddr, uint32_t count) {
+  virtual_addr addr = vmem_alloc(count);
+  if (!addr) {
+    return 0;
+  }
+
+  if (!map_device_range(paddr, addr, count)) {
+    vmem_free(addr, count);
+    return 0;
+  }
+
+  // Each mapping holds a reference, which vmem_free drops. Blocks past the
+  // end of memory have no descriptor and are skipped.
+  for (uint32_t i = 0; i < count; i++) {
+    if (block_to_page(paddr + i * PAGE_SIZE)) {
+      get_block(paddr + i * PAGE_SIZE);
+    }
+  }
+  return addr;
+}
+
+bool vmem_is_alloced(virtual_addr addr) {
+  if (!is_vmem_range(addr & ~(PAGE_SIZE - 1), 1)) {
+    return false;
+  }
+  return bitmap_test(vmem_map_, addr_to_page(addr));
+}
@@ -0,0 +1,62 @@
+#include <devices/clock.h>
+#include <test/unit.h>
+
+NEW_SUITE(ClockTest, 4);
+
+TEST(SlowestTscConvertsExactly) {
+  // A cycle is 250ns, the largest factor the fixed point can hold
+  force_clock_tsc_khz(CLOCK_MIN_TSC_KHZ);
+  EXPECT_EQ(250, cycles_to_ns(1));
+  EXPECT_EQ(1000000, cycles_to_ns(CLOCK_MIN_TSC_KHZ));
+
+  // An hour of cycles doesn't fit in 32 bits, the high half converts too
+  uint64_t hour_ns = 3600 * NS_PER_SECOND;
+  uint64_t ns = cycles_to_ns(CLOCK_MIN_TSC_KHZ * 1000ull * 3600);
+  EXPECT_EQ(hour_ns, ns);
+}
+
+TEST(FastTscConvertsExactly) {
+  // 4GHz, a quarter of a nanosecond per cycle
+  force_clock_tsc_khz(4000000);
+  EXPECT_EQ(0, cycles_to_ns(3));
+  EXPECT_EQ(1, cycles_to_ns(4));
+  uint64_t second_ns = NS_PER_SECOND;
+  uint64_t ns = cycles_to_ns(4000000000ull);
+  EXPECT_EQ(second_ns, ns);
+}
+
+TEST(InexactRateRoundsDown) {
+  // 3GHz has no exact factor, which is rounded down, so a second of cycles
+  // is a little short of a second but never over it
+  force_clock_tsc_khz(3000000);
+  uint64_t ns = cycles_to_ns(3000000000ull);
+  uint64_t min_ns = NS_PER_SECOND - 1000;
+  uint64_t max_ns = NS_PER_SECOND;
+  EXPECT_GTE(ns, min_ns);
+  EXPECT_LTE(ns, max_ns);
+
+  // The error stays under a part per million past 32 bits of cycles
+  ns = cycles_to_ns(3000000000ull * 3600);
+  min_ns = 3600 * NS_PER_SECOND - 3600 * 1000;
+  max_ns = 3600 * NS_PER_SECOND;
+  EXPECT_GTE(ns, min_ns);
+  EXPECT_LTE(ns, max_ns);
+}
+
+TEST(ConversionIsMonotonicAcross32Bits) {
+  force_clock_tsc_khz(3000000);
+  uint64_t below = cycles_to_ns(0xFFFFFFFFull);
+  uint64_t above = cycles_to_ns(0x100000000ull);
+  EXPECT_LTE(below, above);
+  uint64_t next = cycles_to_ns(0x100000000ull + 30);
+  EXPECT_GT(next, above);
+}
+
+END_SUITE();
+
+void test_clock() {
+  // The tests convert at made up rates, the calibrated one comes back after
+  uint32_t khz = clock_tsc_khz();
+  RUN_SUITE(ClockTest);
+  force_clock_tsc_khz(khz);
+}
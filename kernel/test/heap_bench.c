@@ -0,0 +1,153 @@
+#include <asm.h>
+#include <stdio.h>
+
+#include <libk/heap.h>
+#include <test/heap_bench.h>
+
+#define HEAP_BENCH_SLOTS 256       // Live allocations kept by each pattern
+#define HEAP_BENCH_ROUNDS 64       // Rounds of the fixed size churn
+#define HEAP_BENCH_STEPS 16384     // Steps of the random and FIFO patterns
+#define HEAP_BENCH_FIXED_SIZE 64
+#define HEAP_BENCH_MAX_SIZE 4096   // Largest size of the random patterns
+#define HEAP_BENCH_QUEUE_DEPTH 64  // Allocations in flight in the FIFO
+
+static void* heap_bench_slots_[HEAP_BENCH_SLOTS];
+
+// xorshift32, the same seed every run so runs can be compared
+static uint32_t heap_bench_seed_;
+
+static uint32_t bench_random() {
+  heap_bench_seed_ ^= heap_bench_seed_ << 13;
+  heap_bench_seed_ ^= heap_bench_seed_ >> 17;
+  heap_bench_seed_ ^= heap_bench_seed_ << 5;
+  return heap_bench_seed_;
+}
+
+// Random size up to HEAP_BENCH_MAX_SIZE, as likely to be in any power of
+// two range, so small objects are the most common like in real workloads
+static size_t random_size() {
+  uint32_t shift = bench_random() % 8;
+  size_t max = HEAP_BENCH_MAX_SIZE >> shift;
+  return 1 + bench_random() % max;
+}
+
+static void free_slots() {
+  for (size_t i = 0; i < HEAP_BENCH_SLOTS; i++) {
+    if (heap_bench_slots_[i]) {
+      kfree(heap_bench_slots_[i]);
+      heap_bench_slots_[i] = NULL;
+    }
+  }
+}
+
+static void print_result(char* name, uint64_t cycles, uint32_t ops) {
+  printf("Heap bench: %s, %u ops, %u cycles/op\n", name, ops,
+         (uint32_t) (cycles / ops));
+}
+
+// Fills every slot with the same size and frees them all, over and over,
+// the best case of the size class slabs
+static void bench_fixed_churn() {
+  uint64_t start = rdtsc();
+  for (uint32_t round = 0; round < HEAP_BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < HEAP_BENCH_SLOTS; i++) {
+      heap_bench_slots_[i] = kmalloc(HEAP_BENCH_FIXED_SIZE);
+    }
+    for (size_t i = 0; i < HEAP_BENCH_SLOTS; i++) {
+      kfree(heap_bench_slots_[i]);
+    }
+  }
+  uint64_t cycles = rdtsc() - start;
+  for (size_t i = 0; i < HEAP_BENCH_SLOTS; i++) {
+    heap_bench_slots_[i] = NULL;
+  }
+  print_result("fixed size churn", cycles,
+               HEAP_BENCH_ROUNDS * HEAP_BENCH_SLOTS * 2);
+}
+
+// Frees or allocates a random size at a random slot at each step, mixing
+// slabs, heap pages and spans in random order
+static void bench_random_churn() {
+  uint32_t ops = 0;
+  uint64_t start = rdtsc();
+  for (uint32_t step = 0; step < HEAP_BENCH_STEPS; step++) {
+    size_t slot = bench_random() % HEAP_BENCH_SLOTS;
+    if (heap_bench_slots_[slot]) {
+      kfree(heap_bench_slots_[slot]);
+      heap_bench_slots_[slot] = NULL;
+    } else {
+      heap_bench_slots_[slot] = kmalloc(random_size());
+    }
+    ops++;
+  }
+  uint64_t cycles = rdtsc() - start;
+  free_slots();
+  print_result("random size churn", cycles, ops);
+}
+
+// A producer allocates at the head of a queue and a consumer frees its
+// tail, so objects are freed in the order they were allocated, as with
+// buffers passed between two parts of the kernel
+static void bench_producer_consumer() {
+  uint32_t ops = 0;
+  uint64_t start = rdtsc();
+  for (uint32_t step = 0; step < HEAP_BENCH_STEPS; step++) {
+    size_t slot = step % HEAP_BENCH_QUEUE_DEPTH;
+    if (heap_bench_slots_[slot]) {
+      kfree(heap_bench_slots_[slot]);
+      ops++;
+    }
+    heap_bench_slots_[slot] = kmalloc(random_size());
+    ops++;
+  }
+  uint64_t cycles = rdtsc() - start;
+  free_slots();
+  print_result("producer/consumer", cycles, ops);
+}
+
+// Frees every other allocation, resizes the ones left and fills the holes
+// again, so free memory is scattered between live allocations and heap
+// page blocks are split by in place shrinks
+static void bench_fragmentation() {
+  uint32_t ops = 0;
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < HEAP_BENCH_SLOTS; i++) {
+    heap_bench_slots_[i] = kmalloc(random_size());
+    ops++;
+  }
+  for (size_t i = 0; i < HEAP_BENCH_SLOTS; i += 2) {
+    kfree(heap_bench_slots_[i]);
+    heap_bench_slots_[i] = NULL;
+    ops++;
+  }
+  for (size_t i = 1; i < HEAP_BENCH_SLOTS; i += 2) {
+    void* ptr = krealloc(heap_bench_slots_[i], random_size());
+    if (ptr) {
+      heap_bench_slots_[i] = ptr;
+    }
+    ops++;
+  }
+  for (size_t i = 0; i < HEAP_BENCH_SLOTS; i += 2) {
+    heap_bench_slots_[i] = kmalloc(random_size());
+    ops++;
+  }
+  uint64_t cycles = rdtsc() - start;
+
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+  free_slots();
+  print_result("fragmentation stress", cycles, ops);
+  printf("Heap bench: %u KB mapped for %u KB in use, %u percent fragmented\n",
+         stats.bytes_mapped / 1024, stats.bytes_in_use / 1024,
+         stats.fragmentation);
+}
+
+void bench_heap() {
+  heap_bench_seed_ = 0x2545F491;
+  bench_fixed_churn();
+  bench_random_churn();
+  bench_producer_consumer();
+  bench_fragmentation();
+  // Leave the heap as the next user would find it after boot
+  heap_trim();
+}
@@ -0,0 +1,105 @@
+#include <libk/heap.h>
+#include <libk/virt_mem.h>
+#include <test/unit.h>
+
+#if HEAP_DEBUG
+
+NEW_SUITE(HeapDebugTest, 5);
+
+TEST(RedzonesSurroundAllocations) {
+  unsigned char* ptr = kmalloc(20);
+  heap_redzone_t* redzone = (heap_redzone_t*) ptr - 1;
+  EXPECT_EQ(REDZONE_CHECKSUM, redzone->checksum);
+  EXPECT_EQ(20, redzone->size);
+  EXPECT_EQ(0, redzone->guard_pages);
+  for (size_t i = 20; i < 20 + HEAP_REDZONE_SIZE; i++) {
+    EXPECT_EQ(HEAP_REDZONE_BYTE, ptr[i]);
+  }
+
+  kfree(ptr);
+}
+
+TEST(OverflowedAllocationsAreStillFreed) {
+  heap_stats_t before;
+  get_heap_stats(&before);
+
+  // Reported by kfree with the site of the kmalloc
+  unsigned char* ptr = kmalloc(20);
+  ptr[20] = 0;
+  kfree(ptr);
+
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+  EXPECT_EQ(before.frees + 1, stats.frees);
+  EXPECT_EQ(before.bytes_in_use, stats.bytes_in_use);
+}
+
+TEST(DoubleFreeIsRejected) {
+  heap_stats_t before;
+  get_heap_stats(&before);
+
+  // keep holds the slab, so the second kfree reads memory still mapped
+  void* keep = kmalloc(20);
+  void* ptr = kmalloc(20);
+  kfree(ptr);
+  kfree(ptr);
+
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+  EXPECT_EQ(before.frees + 1, stats.frees);
+  kfree(keep);
+}
+
+TEST(ReallocMovesAndKeepsContents) {
+  char* ptr = kmalloc(4);
+  ptr[0] = 'a';
+  ptr[3] = 'z';
+  char* new_ptr = krealloc(ptr, 8);
+  EXPECT_NE(ptr, new_ptr);
+  EXPECT_EQ('a', new_ptr[0]);
+  EXPECT_EQ('z', new_ptr[3]);
+  EXPECT_EQ(HEAP_REDZONE_BYTE, (unsigned char) new_ptr[8]);
+  kfree(new_ptr);
+}
+
+TEST(LargeAllocationsEndAtGuardPages) {
+  if (!HEAP_DEBUG_GUARD_PAGES) {
+    return;
+  }
+
+  size_t size = PAGE_SIZE + 100;
+  unsigned char* ptr = kmalloc(size);
+  heap_redzone_t* redzone = (heap_redzone_t*) ptr - 1;
+  EXPECT_EQ(0, (virtual_addr) redzone % PAGE_SIZE);
+  EXPECT_EQ(2, redzone->guard_pages);
+
+  // The back redzone runs up to the guard page
+  virtual_addr guard = (virtual_addr) redzone + 2 * PAGE_SIZE;
+  EXPECT_EQ(HEAP_REDZONE_BYTE, ptr[size]);
+  EXPECT_EQ(HEAP_REDZONE_BYTE, *((unsigned char*) guard - 1));
+  EXPECT_TRUE(is_guard_page(guard));
+
+  kfree(ptr);
+  EXPECT_FALSE(is_guard_page(guard));
+}
+
+END_SUITE();
+
+#else
+
+NEW_SUITE(HeapDebugTest, 1);
+
+TEST(AllocationsHaveNoRedzones) {
+  // Without redzones, slab objects are handed out from their start
+  void* ptr = kmalloc(HEAP_BLOCK_SIZE * 3);
+  heap_slab_t* slab = get_heap_slab_metadata(ptr);
+  EXPECT_EQ(HEAP_PAGE_SLAB, slab->kind);
+  EXPECT_EQ(0, ((unsigned char*) ptr - slab->alloc_memory) % slab->object_size);
+  kfree(ptr);
+}
+
+END_SUITE();
+
+#endif  // HEAP_DEBUG
+
+void test_heap_debug() { RUN_SUITE(HeapDebugTest); }
@@ -0,0 +1,112 @@
+#include <libk/heap.h>
+#include <libk/heap_profile.h>
+#include <test/unit.h>
+
+#if HEAP_PROFILE_SITES
+
+// Each helper is a single allocation site. The empty asm keeps the call
+// from becoming a tail call, which would leave our caller as the site, and
+// the helpers differ so the compiler can't fold them into one.
+__attribute__((noinline)) static void* alloc_from_site_a(size_t bytes) {
+  void* ptr = kmalloc(bytes);
+  asm volatile("" ::: "memory");
+  return ptr;
+}
+
+__attribute__((noinline)) static void* alloc_small_from_site_b() {
+  void* ptr = kmalloc(16);
+  asm volatile("" ::: "memory");
+  return ptr;
+}
+
+NEW_SUITE(HeapProfileTest, 3);
+
+TEST(SitesAreRankedByBytesAndCount) {
+  void* large[3];
+  void* small[5];
+  for (size_t i = 0; i < 3; i++) {
+    large[i] = alloc_from_site_a(1000);
+  }
+  for (size_t i = 0; i < 5; i++) {
+    small[i] = alloc_small_from_site_b();
+  }
+
+  heap_profile_site_t by_bytes[2];
+  heap_profile_site_t by_count[2];
+  EXPECT_EQ(2, heap_profile_top_sites(by_bytes, 2, false,
+                                      heap_profile_epoch()));
+  EXPECT_EQ(2, heap_profile_top_sites(by_count, 2, true,
+                                      heap_profile_epoch()));
+  EXPECT_EQ(3000, by_bytes[0].bytes);
+  EXPECT_EQ(3, by_bytes[0].count);
+  EXPECT_EQ(80, by_count[0].bytes);
+  EXPECT_EQ(5, by_count[0].count);
+  EXPECT_EQ(by_bytes[0].site, by_count[1].site);
+  EXPECT_EQ(by_bytes[1].site, by_count[0].site);
+
+  for (size_t i = 0; i < 3; i++) {
+    kfree(large[i]);
+  }
+  for (size_t i = 0; i < 5; i++) {
+    kfree(small[i]);
+  }
+  EXPECT_EQ(0, heap_profile_top_sites(by_bytes, 2, false,
+                                      heap_profile_epoch()));
+}
+
+TEST(ReallocGivesAllocationToItsCaller) {
+  char* ptr = alloc_from_site_a(16);
+  heap_profile_site_t before;
+  EXPECT_EQ(1, heap_profile_top_sites(&before, 1, false,
+                                      heap_profile_epoch()));
+
+  // Moves the object to a larger size class
+  ptr = krealloc(ptr, 1000);
+  heap_profile_site_t after;
+  EXPECT_EQ(1, heap_profile_top_sites(&after, 1, false,
+                                      heap_profile_epoch()));
+  EXPECT_NE(before.site, after.site);
+  EXPECT_EQ(1000, after.bytes);
+  EXPECT_EQ(1, after.count);
+
+  kfree(ptr);
+}
+
+TEST(FreeKeepsOtherAllocationsReachable) {
+  void* ptrs[200];
+  for (size_t i = 0; i < 200; i++) {
+    ptrs[i] = alloc_from_site_a(16);
+  }
+
+  // Removing entries shifts back the ones that probed past them
+  for (size_t i = 0; i < 200; i += 2) {
+    kfree(ptrs[i]);
+  }
+  heap_profile_site_t site;
+  heap_profile_top_sites(&site, 1, true, heap_profile_epoch());
+  EXPECT_EQ(100, site.count);
+
+  for (size_t i = 1; i < 200; i += 2) {
+    kfree(ptrs[i]);
+  }
+  EXPECT_EQ(0, heap_profile_top_sites(&site, 1, true, heap_profile_epoch()));
+}
+
+END_SUITE();
+
+#else
+
+NEW_SUITE(HeapProfileTest, 1);
+
+TEST(DisabledProfilerFindsNoSites) {
+  void* ptr = kmalloc(16);
+  heap_profile_site_t site;
+  EXPECT_EQ(0, heap_profile_top_sites(&site, 1, false, 0));
+  kfree(ptr);
+}
+
+END_SUITE();
+
+#endif  // HEAP_PROFILE_SITES
+
+void test_heap_profile() { RUN_SUITE(HeapProfileTest); }
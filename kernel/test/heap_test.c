@@ -1,11 +1,16 @@
+#include <libk/bitmap.h>
 #include <libk/heap.h>
+#include <libk/phys_mem.h>
+#include <libk/vmem.h>
+#include <string.h>
 #include <test/unit.h>
 
-inline static bool map_check(unsigned char* bitmap, size_t block) {
-  return bitmap[block / 8] & (1 << (block % 8));
-}
+// HEAP_DEBUG builds put redzones around every allocation and guard pages
+// around the ones past HEAP_SLAB_MAX_SIZE, which changes the size class, heap
+// page or span an allocation lands in. Assertions on where allocations are
+// laid out are inside #if !HEAP_DEBUG, the rest runs with every heap.
 
-NEW_SUITE(HeapTest, 7);
+NEW_SUITE(HeapTest, 29);
 
 SETUP_SUITE() {
   // Force the tests to start with an empty Heap Page. This way,
@@ -15,192 +20,297 @@ SETUP_SUITE() {
 }
 // extern free_list_t free_list_;
 
-TEST(EmptyMalloc) { 
+TEST(EmptyMalloc) {
   EXPECT_EQ(NULL, kmalloc(0));
 }
 
-TEST(MallocLargerThanBlockLimit) {
-  EXPECT_EQ(NULL, kmalloc(HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE + 1));
+TEST(MallocLargerThanBlockLimitUsesSpan) {
+  size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE + 1;
+  char* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
+
+#if !HEAP_DEBUG
+  heap_span_t* span = get_heap_span_metadata(ptr);
+  EXPECT_EQ(HEAP_PAGE_SPAN, span->kind);
+  EXPECT_EQ(1, span->num_pages);
+  EXPECT_EQ(size, span->size);
+#endif
+
+  kfree(ptr);
+}
+
+TEST(MallocMultiPageSpan) {
+  size_t size = PAGE_SIZE * 4;
+  char* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
+
+#if !HEAP_DEBUG
+  heap_span_t* span = get_heap_span_metadata(ptr);
+  EXPECT_EQ(5, span->num_pages);
+#endif
+
+  // The whole allocation is backed by memory
+  memset(ptr, 0xAB, size);
+  physical_addr last_frame = virt_to_phys((virtual_addr) &ptr[size - 1]);
+  EXPECT_TRUE(is_alloced(last_frame));
+
+  // Freeing the span gives its frames back to the PMM
+  kfree(ptr);
+  EXPECT_FALSE(is_alloced(last_frame));
+}
+
+TEST(MallocMultiMegabyteSpan) {
+  size_t size = 2 * 1024 * 1024;
+  char* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
+
+  ptr[0] = 'a';
+  ptr[size - 1] = 'z';
+  EXPECT_EQ('a', ptr[0]);
+  EXPECT_EQ('z', ptr[size - 1]);
+
+  kfree(ptr);
 }
 
 TEST(MallocFreeExactBlockSize) {
-  size_t size = sizeof(int) * HEAP_BLOCK_SIZE;
+  size_t size = HEAP_SLAB_MAX_SIZE + sizeof(int) * HEAP_BLOCK_SIZE;
   int* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
 
+#if !HEAP_DEBUG
   size_t expected_allocated_block_count = size / HEAP_BLOCK_SIZE;
   heap_page_t* heap_page = get_heap_block_metadata(ptr);
-  EXPECT_EQ(heap_page->num_available_blocks, 
+  EXPECT_EQ(heap_page->num_available_blocks,
       HEAP_BLOCK_COUNT - expected_allocated_block_count);
-  
+
   // Expect the alloced bitmap has the alloced blocks bits set
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_TRUE(map_check(heap_page->alloced_block_bitmap, i));
+    EXPECT_TRUE(bitmap_test(heap_page->alloced_block_bitmap, i));
   }
 
   // Expect the first_alloced_bitmap has only the first block bit set
-  EXPECT_TRUE(map_check(heap_page->first_alloced_bitmap, 0));
+  EXPECT_TRUE(bitmap_test(heap_page->first_alloced_bitmap, 0));
   for (size_t i = 1; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 
   // Clean-up
   kfree(ptr);
+#if !HEAP_DEBUG
   EXPECT_EQ(heap_page->num_available_blocks, HEAP_BLOCK_COUNT);
   // Assert we cleaned the bitmaps
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->alloced_block_bitmap, i));
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->alloced_block_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 }
 
 TEST(MallocFreeNonExactBlockSize) {
-  size_t size = sizeof(int) * (HEAP_BLOCK_SIZE + 5);
+  size_t size = HEAP_SLAB_MAX_SIZE + sizeof(int) * (HEAP_BLOCK_SIZE + 5);
   int* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
 
+#if !HEAP_DEBUG
   size_t expected_allocated_block_count = size / HEAP_BLOCK_SIZE + 1;
   heap_page_t* heap_page = get_heap_block_metadata(ptr);
-  EXPECT_EQ(heap_page->num_available_blocks, 
+  EXPECT_EQ(heap_page->num_available_blocks,
       HEAP_BLOCK_COUNT - expected_allocated_block_count);
 
   // Expect the alloced bitmap has the alloced blocks bits set
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_TRUE(map_check(heap_page->alloced_block_bitmap, i));
+    EXPECT_TRUE(bitmap_test(heap_page->alloced_block_bitmap, i));
   }
 
   // Expect the first_alloced_bitmap has only the first block bit set
-  EXPECT_TRUE(map_check(heap_page->first_alloced_bitmap, 0));
+  EXPECT_TRUE(bitmap_test(heap_page->first_alloced_bitmap, 0));
   for (size_t i = 1; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 
   // Clean-up
   kfree(ptr);
+#if !HEAP_DEBUG
   EXPECT_EQ(heap_page->num_available_blocks, HEAP_BLOCK_COUNT);
   // Assert we cleaned the bitmaps
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->alloced_block_bitmap, i));
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->alloced_block_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 }
 
 TEST(MultipleMallocAndFrees) {
-  size_t alloc1_size = sizeof(int) * 32; // 8 blocks
-  size_t alloc2_size = sizeof(int) * 33; // 9 blocks
-  size_t alloc3_size = sizeof(int) * 10; // 3 block
+  size_t alloc_size = sizeof(int) * 10; // 48 bytes size class
+
+  int* ptr1 = kmalloc(alloc_size);
+  int* ptr2 = kmalloc(alloc_size);
+  int* ptr3 = kmalloc(alloc_size);
+
+  // Objects of the same size class are handed out from the same slab
+  heap_slab_t* slab = get_heap_slab_metadata(ptr1);
+  EXPECT_EQ(slab, get_heap_slab_metadata(ptr2));
+  EXPECT_EQ(slab, get_heap_slab_metadata(ptr3));
+  EXPECT_EQ(HEAP_PAGE_SLAB, slab->kind);
+#if !HEAP_DEBUG
+  EXPECT_EQ(48, slab->object_size);
+#endif
+
+  size_t free_objects = slab->num_free;
+  kfree(ptr2);
+  EXPECT_EQ(free_objects + 1, slab->num_free);
 
-  int* ptr1 = kmalloc(alloc1_size);
-  int* ptr2 = kmalloc(alloc2_size);
-  int* ptr3 = kmalloc(alloc3_size);
+  // A freed object is the first one to be reused by its size class
+  int* ptr4 = kmalloc(alloc_size - 1);
+  EXPECT_EQ(ptr2, ptr4);
+  EXPECT_EQ(free_objects, slab->num_free);
 
-  size_t expected_allocated_block_count = 8 + 9 + 3;
-  heap_page_t* heap_page = get_heap_block_metadata(ptr1);
-  EXPECT_EQ(heap_page->num_available_blocks, 
-      HEAP_BLOCK_COUNT - expected_allocated_block_count);
+  kfree(ptr1);
+  kfree(ptr3);
+  kfree(ptr4);
+  EXPECT_EQ(free_objects + 3, slab->num_free);
+}
 
-  // Expect the alloced bitmap has the alloced blocks bits set
-  for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_TRUE(map_check(heap_page->alloced_block_bitmap, i));
-  }
+TEST(SizeClasses) {
+  EXPECT_EQ(-1, get_size_class(0));
+  EXPECT_EQ(16, get_size_class_size(get_size_class(1)));
+  EXPECT_EQ(16, get_size_class_size(get_size_class(16)));
+  EXPECT_EQ(32, get_size_class_size(get_size_class(17)));
+  EXPECT_EQ(128, get_size_class_size(get_size_class(100)));
+  EXPECT_EQ(512, get_size_class_size(get_size_class(HEAP_SLAB_MAX_SIZE)));
+  EXPECT_EQ(-1, get_size_class(HEAP_SLAB_MAX_SIZE + 1));
+}
 
-  // Expect the first_alloced_bitmap has only the first block bit set
-  // for each alloc
-  for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    if (i == 0 || i == 8 || i == 17) {
-      EXPECT_TRUE(map_check(heap_page->first_alloced_bitmap, i));
-    } else {
-      EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
-    }
-  }
+TEST(DifferentSizeClassesUseDifferentSlabs) {
+  int* ptr1 = kmalloc(16);
+  int* ptr2 = kmalloc(100);
+  int* ptr3 = kmalloc(HEAP_SLAB_MAX_SIZE);
+  EXPECT_NE(NULL, ptr3);
+
+#if !HEAP_DEBUG
+  heap_slab_t* slab1 = get_heap_slab_metadata(ptr1);
+  heap_slab_t* slab2 = get_heap_slab_metadata(ptr2);
+  heap_slab_t* slab3 = get_heap_slab_metadata(ptr3);
+  EXPECT_NE(slab1, slab2);
+  EXPECT_NE(slab2, slab3);
+  EXPECT_EQ(16, slab1->object_size);
+  EXPECT_EQ(128, slab2->object_size);
+  EXPECT_EQ(512, slab3->object_size);
+#endif
 
   kfree(ptr1);
   kfree(ptr2);
   kfree(ptr3);
-  // Assert we cleaned the bitmaps
-  for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->alloced_block_bitmap, i));
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+}
+
+TEST(FullSlabGrowsNewSlab) {
+  size_t objects_per_slab = HEAP_SLAB_MEMORY_SIZE / HEAP_SLAB_MAX_SIZE;
+  int* ptrs[HEAP_SLAB_MEMORY_SIZE / HEAP_SLAB_MAX_SIZE + 1];
+  for (size_t i = 0; i <= objects_per_slab; i++) {
+    ptrs[i] = kmalloc(HEAP_SLAB_MAX_SIZE);
+    EXPECT_NE(NULL, ptrs[i]);
+  }
+
+  // The last object couldn't fit in the slab of the first one
+  EXPECT_NE(get_heap_slab_metadata(ptrs[0]),
+            get_heap_slab_metadata(ptrs[objects_per_slab]));
+
+  for (size_t i = 0; i <= objects_per_slab; i++) {
+    kfree(ptrs[i]);
   }
 }
 
 TEST(MallocMaxBlockSize) {
   size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
   int* ptr = kmalloc(size);
+  EXPECT_NE(NULL, ptr);
 
+#if !HEAP_DEBUG
   size_t expected_allocated_block_count = size / HEAP_BLOCK_SIZE;
   heap_page_t* heap_page = get_heap_block_metadata(ptr);
-  EXPECT_EQ(heap_page->num_available_blocks, 
+  EXPECT_EQ(heap_page->num_available_blocks,
       HEAP_BLOCK_COUNT - expected_allocated_block_count);
 
    // Expect the alloced bitmap has the alloced blocks bits set
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_TRUE(map_check(heap_page->alloced_block_bitmap, i));
+    EXPECT_TRUE(bitmap_test(heap_page->alloced_block_bitmap, i));
   }
 
   // Expect the first_alloced_bitmap has only the first block bit set
-  EXPECT_TRUE(map_check(heap_page->first_alloced_bitmap, 0));
+  EXPECT_TRUE(bitmap_test(heap_page->first_alloced_bitmap, 0));
   for (size_t i = 1; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 
   // Clean-up
   kfree(ptr);
+#if !HEAP_DEBUG
   EXPECT_EQ(heap_page->num_available_blocks, HEAP_BLOCK_COUNT);
   // Assert we cleaned the bitmaps
   for (size_t i = 0; i < expected_allocated_block_count; i++) {
-    EXPECT_FALSE(map_check(heap_page->alloced_block_bitmap, i));
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->alloced_block_bitmap, i));
+    EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap, i));
   }
+#endif
 }
 
 TEST(InterleavingMallocFreeAndMalloc) {
-  // Alloc five allocations of size of increasing block sizes
-  int* ptr1 = kmalloc(HEAP_BLOCK_SIZE * 1);
-  int* ptr2 = kmalloc(HEAP_BLOCK_SIZE * 2);
-  int* ptr3 = kmalloc(HEAP_BLOCK_SIZE * 3);
-  int* ptr4 = kmalloc(HEAP_BLOCK_SIZE * 4);
-  int* ptr5 = kmalloc(HEAP_BLOCK_SIZE * 5);
-
-  heap_page_t* heap_page = get_heap_block_metadata(ptr1);
-  EXPECT_EQ(heap_page->num_available_blocks, HEAP_BLOCK_COUNT - 15);
-
-  // Free ptr4
+  // Five objects of the 64 bytes size class, with an allocation from a heap
+  // page in between
+  size_t object_size = HEAP_BLOCK_SIZE * 4;
+  size_t blocks_size = HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE;
+  int* ptr1 = kmalloc(object_size);
+  int* ptr2 = kmalloc(object_size);
+  int* ptr3 = kmalloc(object_size);
+  int* blocks = kmalloc(blocks_size);
+  int* ptr4 = kmalloc(object_size);
+  int* ptr5 = kmalloc(object_size);
+
+  heap_slab_t* slab = get_heap_slab_metadata(ptr1);
+  EXPECT_EQ(slab, get_heap_slab_metadata(ptr5));
+  size_t free_objects = slab->num_free;
+#if !HEAP_DEBUG
+  heap_page_t* heap_page = get_heap_block_metadata(blocks);
+  EXPECT_EQ(HEAP_PAGE_BLOCKS, heap_page->kind);
+  size_t available_blocks = heap_page->num_available_blocks;
+#endif
+
+  // Free ptr4, the next object of its size class takes its place
   kfree(ptr4);
+  int* ptr6 = kmalloc(object_size - 1);
+  EXPECT_EQ(ptr4, ptr6);
+  EXPECT_EQ(free_objects, slab->num_free);
 
-  // Alloc a new ptr of size equal to 3 blocks
-  int* ptr6 = kmalloc(HEAP_BLOCK_SIZE * 3);
-
-  // Expect ptr6 to be allocated in between ptr 3 and 5
-  EXPECT_GT(ptr6, ptr3);
-  EXPECT_LT(ptr6, ptr5);
-
-  // Alloc a new ptr of size of 1 blocks
-  int* ptr7 = kmalloc(HEAP_BLOCK_SIZE * 1);
-
-  // Expect ptr6 to be allocated in between ptr 6 and 5
-  EXPECT_GT(ptr7, ptr6);
-  EXPECT_LT(ptr7, ptr5);
-
-  // Finally, allocated a new ptr of size 6
-  int* ptr8 = kmalloc(HEAP_BLOCK_SIZE * 6);
-
-  // Expect ptr8 to be allocated in between after ptr 5
-  EXPECT_GT(ptr8, ptr5);
-
-  // Free everything and assert the resulting bitmap is empty
-  kfree(ptr1);
+  // Freeing objects leaves the heap page alone, and the other way around
   kfree(ptr2);
   kfree(ptr3);
+  EXPECT_EQ(free_objects + 2, slab->num_free);
+#if !HEAP_DEBUG
+  EXPECT_EQ(available_blocks, heap_page->num_available_blocks);
+#endif
+  kfree(blocks);
+#if !HEAP_DEBUG
+  EXPECT_EQ(available_blocks + HEAP_BLOCKS_NEED_FOR_N_BYTES(blocks_size),
+            heap_page->num_available_blocks);
+#endif
+  EXPECT_EQ(free_objects + 2, slab->num_free);
+
+  // The objects freed last are handed out first
+  int* ptr7 = kmalloc(object_size);
+  int* ptr8 = kmalloc(object_size);
+  EXPECT_EQ(ptr3, ptr7);
+  EXPECT_EQ(ptr2, ptr8);
+
+  // Free everything. The slab may be released with its last object.
+  kfree(ptr1);
   kfree(ptr5);
   kfree(ptr6);
   kfree(ptr7);
+  EXPECT_EQ(free_objects + 4, slab->num_free);
   kfree(ptr8);
-  EXPECT_EQ(heap_page->num_available_blocks, HEAP_BLOCK_COUNT);
-
-  // Assert we cleaned the bitmaps
-  for (size_t i = 0; i < HEAP_BLOCK_COUNT; i++) {
-    EXPECT_FALSE(map_check(heap_page->alloced_block_bitmap, i));
-    EXPECT_FALSE(map_check(heap_page->first_alloced_bitmap, i));
-  }
 }
 
 TEST(FreeNull) {
@@ -210,24 +320,376 @@ TEST(FreeNull) {
 TEST(FreeNotMallocedDoesntWork) {
   size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
   int* ptr = kmalloc(size);
+  ptr[0] = 1;
 
+#if !HEAP_DEBUG
   size_t expected_allocated_block_count = size / HEAP_BLOCK_SIZE;
   heap_page_t* heap_page = get_heap_block_metadata(ptr);
-  EXPECT_EQ(heap_page->num_available_blocks, 
+  EXPECT_EQ(heap_page->num_available_blocks,
       HEAP_BLOCK_COUNT - expected_allocated_block_count);
+#endif
 
   // Tries to free a pointer inside an allocated block, but that isn't the
   // block start. In the future it should abort, for now it just does nothing
   kfree(ptr + 1);
 
   // Assert we didn't actually free anything
-  EXPECT_EQ(heap_page->num_available_blocks, 
+  EXPECT_EQ(1, ptr[0]);
+#if !HEAP_DEBUG
+  EXPECT_EQ(heap_page->num_available_blocks,
       HEAP_BLOCK_COUNT - expected_allocated_block_count);
+#endif
+
+  kfree(ptr);
+}
+
+TEST(FreeNotMallocedSlabObjectDoesntWork) {
+  // other keeps the slab from being released while we check it
+  int* other = kmalloc(sizeof(int) * 10);
+  int* ptr = kmalloc(sizeof(int) * 10);
+  heap_slab_t* slab = get_heap_slab_metadata(ptr);
+  size_t free_objects = slab->num_free;
+
+  // The next free object starts at an object boundary, but it was never
+  // handed out, so the slab rejects it
+  void* unused = slab->free_list;
+  kfree(unused);
+  EXPECT_EQ(free_objects, slab->num_free);
+#if !HEAP_DEBUG
+  // It is still the next object of the size class
+  int* next = kmalloc(sizeof(int) * 10);
+  EXPECT_EQ(unused, next);
+  kfree(next);
+#endif
+
+  // Objects that were already freed are rejected too
+  kfree(ptr);
+  kfree(ptr);
+  EXPECT_EQ(free_objects + 1, slab->num_free);
+  kfree(other);
+}
+
+TEST(FreeNotMallocedSpanDoesntWork) {
+  char* ptr = kmalloc(PAGE_SIZE * 2);
+  ptr[0] = 'a';
+
+  // Spans only hold one allocation, so anything but its start is rejected
+  kfree(ptr + HEAP_BLOCK_SIZE);
+  EXPECT_EQ('a', ptr[0]);
+#if !HEAP_DEBUG
+  heap_span_t* span = get_heap_span_metadata(ptr);
+  EXPECT_EQ(MALLOCED_CHECKSUM, span->checksum);
+  EXPECT_EQ(3, span->num_pages);
+#endif
 
   kfree(ptr);
 }
 
+TEST(ReallocNullMallocs) {
+  int* ptr = krealloc(NULL, sizeof(int));
+  EXPECT_NE(NULL, ptr);
+  kfree(ptr);
+}
+
+TEST(ReallocWithinSizeClassKeepsObject) {
+  char* ptr = kmalloc(20);
+  memset(ptr, 'a', 20);
+
+  // 20 and 30 bytes are both served by the 32 bytes size class
+  char* new_ptr = krealloc(ptr, 30);
+#if !HEAP_DEBUG
+  EXPECT_EQ(ptr, new_ptr);
+#endif
+  EXPECT_EQ('a', new_ptr[19]);
+
+  kfree(new_ptr);
+}
+
+TEST(ReallocPastSizeClassMovesObject) {
+  char* ptr = kmalloc(20);
+  memset(ptr, 'a', 20);
+  heap_slab_t* slab = get_heap_slab_metadata(ptr);
+  size_t free_objects = slab->num_free;
+
+  char* new_ptr = krealloc(ptr, 100);
+  EXPECT_NE(ptr, new_ptr);
+  for (size_t i = 0; i < 20; i++) {
+    EXPECT_EQ('a', new_ptr[i]);
+  }
+  // The old object went back to its slab
+  EXPECT_EQ(free_objects + 1, slab->num_free);
+
+  kfree(new_ptr);
+}
+
+TEST(ReallocGrowsAndShrinksInPlaceInHeapPage) {
+  size_t size = HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE;
+  char* ptr = kmalloc(size);
+  ptr[0] = 'a';
+#if !HEAP_DEBUG
+  heap_page_t* heap_page = get_heap_block_metadata(ptr);
+  size_t available_blocks = heap_page->num_available_blocks;
+#endif
+
+  // The blocks after the allocation are free, so it grows in place
+  char* new_ptr = krealloc(ptr, size + HEAP_BLOCK_SIZE * 10);
+  EXPECT_EQ('a', new_ptr[0]);
+#if !HEAP_DEBUG
+  EXPECT_EQ(ptr, new_ptr);
+  EXPECT_EQ(available_blocks - 10, heap_page->num_available_blocks);
+  EXPECT_TRUE(bitmap_test(heap_page->alloced_block_bitmap,
+                        HEAP_BLOCKS_NEED_FOR_N_BYTES(size) + 9));
+  EXPECT_FALSE(bitmap_test(heap_page->first_alloced_bitmap,
+                         HEAP_BLOCKS_NEED_FOR_N_BYTES(size)));
+#endif
+
+  // Shrinking hands the tail blocks back to the heap page
+  new_ptr = krealloc(new_ptr, size);
+  EXPECT_EQ('a', new_ptr[0]);
+#if !HEAP_DEBUG
+  EXPECT_EQ(ptr, new_ptr);
+  EXPECT_EQ(available_blocks, heap_page->num_available_blocks);
+  EXPECT_FALSE(bitmap_test(heap_page->alloced_block_bitmap,
+                         HEAP_BLOCKS_NEED_FOR_N_BYTES(size)));
+#endif
+
+  kfree(new_ptr);
+}
+
+TEST(ReallocGrowsAndShrinksSpanInPlace) {
+  char* ptr = kmalloc(PAGE_SIZE * 2);
+  memset(ptr, 'a', PAGE_SIZE * 2);
+#if !HEAP_DEBUG
+  heap_span_t* span = get_heap_span_metadata(ptr);
+  EXPECT_EQ(3, span->num_pages);
+#endif
+
+  // Nothing was allocated after the span, so it grows into the next pages
+  char* new_ptr = krealloc(ptr, PAGE_SIZE * 8);
+#if !HEAP_DEBUG
+  EXPECT_EQ(ptr, new_ptr);
+  EXPECT_EQ(9, span->num_pages);
+#endif
+  EXPECT_EQ('a', new_ptr[PAGE_SIZE * 2 - 1]);
+  new_ptr[PAGE_SIZE * 8 - 1] = 'z';
+
+  new_ptr = krealloc(new_ptr, PAGE_SIZE);
+#if !HEAP_DEBUG
+  EXPECT_EQ(ptr, new_ptr);
+  EXPECT_EQ(2, span->num_pages);
+#endif
+  EXPECT_EQ('a', new_ptr[PAGE_SIZE - 1]);
+
+  kfree(new_ptr);
+}
+
+TEST(ReallocSpanMovesWhenNotLast) {
+  char* ptr = kmalloc(PAGE_SIZE * 2);
+  memset(ptr, 'a', PAGE_SIZE * 2);
+  char* blocker = kmalloc(PAGE_SIZE * 2);
+
+  char* new_ptr = krealloc(ptr, PAGE_SIZE * 4);
+  EXPECT_NE(ptr, new_ptr);
+  EXPECT_EQ('a', new_ptr[0]);
+  EXPECT_EQ('a', new_ptr[PAGE_SIZE * 2 - 1]);
+
+  kfree(blocker);
+  kfree(new_ptr);
+}
+
+TEST(FreeRunIndexCoalescesFreedBlocks) {
+  size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
+  char* ptr1 = kmalloc(size);
+#if !HEAP_DEBUG
+  heap_page_t* heap_page = get_heap_block_metadata(ptr1);
+  EXPECT_EQ(0, heap_page->largest_free_run);
+#endif
+
+  // Leaves ptr1 with the first 10 blocks of the page
+  ptr1 = krealloc(ptr1, HEAP_BLOCK_SIZE * 10);
+#if !HEAP_DEBUG
+  EXPECT_EQ(HEAP_BLOCK_COUNT - 10, heap_page->largest_free_run);
+  EXPECT_EQ(10, heap_page->largest_free_run_start);
+#endif
+
+  // ptr2 takes the blocks right after ptr1
+  size_t size2 = HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE;
+  char* ptr2 = kmalloc(size2);
+  EXPECT_NE(NULL, ptr2);
+#if !HEAP_DEBUG
+  EXPECT_EQ(heap_page, get_heap_block_metadata(ptr2));
+  EXPECT_EQ(ptr1 + HEAP_BLOCK_SIZE * 10, ptr2);
+  size_t ptr2_blocks = HEAP_BLOCKS_NEED_FOR_N_BYTES(size2);
+  EXPECT_EQ(HEAP_BLOCK_COUNT - 10 - ptr2_blocks,
+            heap_page->largest_free_run);
+  EXPECT_EQ(10 + ptr2_blocks, heap_page->largest_free_run_start);
+#endif
+
+  // Freeing ptr1 leaves a run shorter than the one after ptr2
+  kfree(ptr1);
+#if !HEAP_DEBUG
+  EXPECT_EQ(HEAP_BLOCK_COUNT - 10 - ptr2_blocks,
+            heap_page->largest_free_run);
+#endif
+
+  // Freeing ptr2 merges it with the runs on both sides
+  kfree(ptr2);
+#if !HEAP_DEBUG
+  EXPECT_EQ(HEAP_BLOCK_COUNT, heap_page->largest_free_run);
+  EXPECT_EQ(0, heap_page->largest_free_run_start);
+#endif
+}
+
+TEST(HeapPagesWithoutFittingRunAreSkipped) {
+  size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
+  char* ptr1 = kmalloc(size);
+  char* ptr2 = kmalloc(size);
+  EXPECT_NE(get_heap_block_metadata(ptr1), get_heap_block_metadata(ptr2));
+
+  // Once ptr1 shrinks, its page can fit a request again
+  ptr1 = krealloc(ptr1, HEAP_BLOCK_SIZE);
+  char* ptr3 = kmalloc(HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE);
+  EXPECT_NE(NULL, ptr3);
+#if !HEAP_DEBUG
+  EXPECT_EQ(get_heap_block_metadata(ptr1), get_heap_block_metadata(ptr3));
+#endif
+
+  kfree(ptr1);
+  kfree(ptr2);
+  kfree(ptr3);
+}
+
+TEST(HeapTrimReleasesEmptyPages) {
+  heap_trim();
+  size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
+  char* ptr1 = kmalloc(size);
+  char* ptr2 = kmalloc(size);
+  heap_page_t* heap_page1 = get_heap_block_metadata(ptr1);
+  heap_page_t* heap_page2 = get_heap_block_metadata(ptr2);
+
+  // Below the limit, empty pages are kept for later allocations
+  kfree(ptr1);
+  kfree(ptr2);
+#if !HEAP_DEBUG
+  EXPECT_TRUE(vmem_is_alloced((virtual_addr) heap_page1));
+  EXPECT_TRUE(vmem_is_alloced((virtual_addr) heap_page2));
+
+  EXPECT_EQ(2, heap_trim());
+#else
+  heap_trim();
+#endif
+  EXPECT_FALSE(vmem_is_alloced((virtual_addr) heap_page1));
+  EXPECT_FALSE(vmem_is_alloced((virtual_addr) heap_page2));
+  EXPECT_EQ(0, heap_trim());
+}
+
+TEST(EmptyHeapPagesPastLimitAreReleased) {
+  heap_trim();
+  size_t size = HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE;
+  char* ptrs[HEAP_MAX_EMPTY_PAGES + 2];
+  heap_page_t* heap_pages[HEAP_MAX_EMPTY_PAGES + 2];
+  for (size_t i = 0; i < HEAP_MAX_EMPTY_PAGES + 2; i++) {
+    ptrs[i] = kmalloc(size);
+    heap_pages[i] = get_heap_block_metadata(ptrs[i]);
+  }
+  for (size_t i = 0; i < HEAP_MAX_EMPTY_PAGES + 2; i++) {
+    kfree(ptrs[i]);
+  }
+
+#if !HEAP_DEBUG
+  // The first pages to become empty are kept, the rest are given back
+  for (size_t i = 0; i < HEAP_MAX_EMPTY_PAGES; i++) {
+    EXPECT_TRUE(vmem_is_alloced((virtual_addr) heap_pages[i]));
+  }
+#endif
+  EXPECT_FALSE(vmem_is_alloced((virtual_addr) heap_pages[HEAP_MAX_EMPTY_PAGES]));
+  EXPECT_FALSE(
+      vmem_is_alloced((virtual_addr) heap_pages[HEAP_MAX_EMPTY_PAGES + 1]));
+#if !HEAP_DEBUG
+  EXPECT_EQ(HEAP_MAX_EMPTY_PAGES, heap_trim());
+#endif
+}
+
+TEST(HeapTrimReleasesEmptySlabs) {
+  heap_trim();
+  size_t object_size = get_size_class_size(get_size_class(HEAP_SLAB_MAX_SIZE));
+  size_t count = HEAP_SLAB_MEMORY_SIZE / object_size;
+  void* ptrs[HEAP_SLAB_MEMORY_SIZE / HEAP_SLAB_MAX_SIZE] = {NULL};
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = kmalloc(HEAP_SLAB_MAX_SIZE);
+  }
+  heap_page_t* slab = get_heap_block_metadata(ptrs[0]);
+  for (size_t i = 0; i < count; i++) {
+    kfree(ptrs[i]);
+  }
+
+#if !HEAP_DEBUG
+  EXPECT_TRUE(vmem_is_alloced((virtual_addr) slab));
+  EXPECT_EQ(1, heap_trim());
+#else
+  heap_trim();
+#endif
+  EXPECT_FALSE(vmem_is_alloced((virtual_addr) slab));
+}
+
+TEST(HeapStatsCountAllocationsAndFrees) {
+  heap_stats_t before;
+  get_heap_stats(&before);
+
+  void* object = kmalloc(HEAP_BLOCK_SIZE);
+  void* blocks = kmalloc(HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE);
+  void* span = kmalloc(PAGE_SIZE * 2);
+
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+#if !HEAP_DEBUG
+  int32_t size_class = get_size_class(HEAP_BLOCK_SIZE);
+  EXPECT_EQ(before.size_class_allocs[size_class] + 1,
+            stats.size_class_allocs[size_class]);
+  EXPECT_EQ(before.heap_page_allocs + 1, stats.heap_page_allocs);
+  EXPECT_EQ(before.span_allocs + 1, stats.span_allocs);
+  EXPECT_EQ(before.spans + 1, stats.spans);
+  EXPECT_EQ(before.bytes_in_use + HEAP_BLOCK_SIZE + HEAP_SLAB_MAX_SIZE
+            + HEAP_BLOCK_SIZE + PAGE_SIZE * 2, stats.bytes_in_use);
+#endif
+  bool mapped_covers_in_use = stats.bytes_in_use < stats.bytes_mapped;
+  EXPECT_TRUE(mapped_covers_in_use);
+
+  kfree(object);
+  kfree(blocks);
+  kfree(span);
+  get_heap_stats(&stats);
+  EXPECT_EQ(before.frees + 3, stats.frees);
+  EXPECT_EQ(before.bytes_in_use, stats.bytes_in_use);
+  EXPECT_EQ(before.spans, stats.spans);
+}
+
+TEST(HeapStatsTrackFragmentation) {
+  force_empty_heap_page();
+  heap_stats_t stats;
+  get_heap_stats(&stats);
+  EXPECT_EQ(1, stats.heap_pages);
+  EXPECT_EQ(HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE, stats.largest_free_run);
+  EXPECT_EQ(0, stats.fragmentation);
+
+  // Freeing ptr1 leaves a hole before ptr2, apart from the run after it
+  char* ptr1 = kmalloc(HEAP_BLOCK_COUNT * HEAP_BLOCK_SIZE);
+  ptr1 = krealloc(ptr1, HEAP_BLOCK_SIZE * 10);
+  size_t size2 = HEAP_SLAB_MAX_SIZE + HEAP_BLOCK_SIZE;
+  char* ptr2 = kmalloc(size2);
+  kfree(ptr1);
+#if !HEAP_DEBUG
+  get_heap_stats(&stats);
+  size_t free_blocks = HEAP_BLOCK_COUNT - HEAP_BLOCKS_NEED_FOR_N_BYTES(size2);
+  EXPECT_EQ((free_blocks - 10) * HEAP_BLOCK_SIZE, stats.largest_free_run);
+  EXPECT_EQ(10 * 100 / free_blocks, stats.fragmentation);
+#endif
+
+  kfree(ptr2);
+  get_heap_stats(&stats);
+  EXPECT_EQ(0, stats.fragmentation);
+}
 
 END_SUITE();
 
-void test_heap() { RUN_SUITE(HeapTest); }
\ No newline at end of file
+void test_heap() { RUN_SUITE(HeapTest); }
@@ -1,7 +1,7 @@
 #include <libk/phys_mem.h>
 #include <test/unit.h>
 
-NEW_SUITE(PhysMemTest, 7);
+NEW_SUITE(PhysMemTest, 14);
 
 TEST(AllocBlock) {
   physical_addr addr = alloc_block();
@@ -73,6 +73,75 @@ TEST(AllocTenFreeMiddleAndReallocEnd) {
   }
 }
 
+TEST(AllocBlockReusesFreedLowerBlock) {
+  physical_addr first_addr = alloc_block();
+  physical_addr last_block = alloc_blocks(64);
+  EXPECT_LT(first_addr, last_block);
+
+  // The search cursor moved past first_addr, freeing it must move it back
+  free_block(first_addr);
+  physical_addr second_addr = alloc_block();
+  EXPECT_EQ(first_addr, second_addr);
+  free_blocks(last_block, 64);
+}
+
+TEST(AllocBlocksOrderIsAligned) {
+  physical_addr first_block = alloc_blocks_order(5);
+  EXPECT_TRUE(first_block);
+  EXPECT_EQ(first_block % (PHYS_BLOCK_SIZE << 5), 0);
+  for (int i = 0; i < 32; i++) {
+    EXPECT_TRUE(is_alloced(first_block + (PHYS_BLOCK_SIZE * i)));
+  }
+  free_blocks(first_block, 32);
+  EXPECT_FALSE(is_alloced(first_block));
+}
+
+TEST(AllocBlocksOrderTooLarge) {
+  EXPECT_EQ(alloc_blocks_order(PHYS_BUDDY_MAX_ORDER + 1), 0);
+}
+
+TEST(FreeBlocksMergesBuddies) {
+  physical_addr first_block = alloc_blocks_order(4);
+
+  // Freeing every block on its own only gives the same 16 blocks back to
+  // the next order 4 allocation if the buddies were merged again
+  for (int i = 0; i < 16; i++) {
+    free_block(first_block + (PHYS_BLOCK_SIZE * i));
+  }
+  physical_addr new_alloc = alloc_blocks_order(4);
+  EXPECT_EQ(new_alloc, first_block);
+  free_blocks(new_alloc, 16);
+}
+
+TEST(AllocBlockSetsPageDescriptor) {
+  physical_addr addr = alloc_block();
+  page_t* page = block_to_page(addr);
+  EXPECT_TRUE(page);
+  EXPECT_EQ(page->refcount, 1);
+  EXPECT_EQ(page->mapcount, 0);
+  EXPECT_EQ(page->flags, 0);
+  free_block(addr);
+  EXPECT_EQ(page->refcount, 0);
+}
+
+TEST(PutBlockFreesOnLastReference) {
+  physical_addr addr = alloc_block();
+  get_block(addr);
+  EXPECT_EQ(block_to_page(addr)->refcount, 2);
+
+  put_block(addr);
+  EXPECT_TRUE(is_alloced(addr));
+  put_block(addr);
+  EXPECT_FALSE(is_alloced(addr));
+  EXPECT_EQ(block_to_page(addr)->refcount, 0);
+}
+
+TEST(KernelBlocksAreReserved) {
+  page_t* page = block_to_page(KERNEL_START_PADDR);
+  EXPECT_EQ(PAGE_RESERVED, (page->flags & PAGE_RESERVED));
+  EXPECT_EQ(page->refcount, 1);
+}
+
 END_SUITE();
 
 void test_phys_mem() { RUN_SUITE(PhysMemTest); }
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include <devices/clock.h>
+#include <devices/timer.h>
+#include <stddef.h>
+#include <test/unit.h>
+
+// Kept out of the stack, so a failed test leaves nothing dangling in the
+// queue. They are all cancelled once the suite is done.
+static timer_event_t a_, b_, c_, d_;
+
+static void ignore_event(void* data) {
+  (void) data;
+}
+
+// Deadlines an hour from now, far past the end of the suite
+static uint64_t deadline(uint32_t ms) {
+  return now_ns() + 3600 * NS_PER_SECOND + ms * 1000000ull;
+}
+
+// The suite runs before timer_install, so no event fires while queued
+NEW_SUITE(TimerTest, 4);
+
+TEST(EventsAreQueuedByDeadline) {
+  timer_add(&b_, deadline(20), ignore_event, NULL);
+  timer_add(&a_, deadline(10), ignore_event, NULL);
+  timer_add(&d_, deadline(40), ignore_event, NULL);
+  timer_add(&c_, deadline(30), ignore_event, NULL);
+
+  EXPECT_EQ(&a_, timer_first_event());
+  EXPECT_EQ(&b_, a_.next);
+  EXPECT_EQ(&c_, b_.next);
+  EXPECT_EQ(&d_, c_.next);
+  EXPECT_EQ(NULL, d_.next);
+
+  timer_cancel(&a_);
+  timer_cancel(&b_);
+  timer_cancel(&c_);
+  timer_cancel(&d_);
+  EXPECT_EQ(NULL, timer_first_event());
+}
+
+TEST(SameDeadlineKeepsAddOrder) {
+  uint64_t when = deadline(10);
+  timer_add(&a_, when, ignore_event, NULL);
+  timer_add(&b_, when, ignore_event, NULL);
+
+  EXPECT_EQ(&a_, timer_first_event());
+  EXPECT_EQ(&b_, a_.next);
+
+  timer_cancel(&a_);
+  timer_cancel(&b_);
+}
+
+TEST(CancelHeadAndMiddleEvents) {
+  timer_add(&a_, deadline(10), ignore_event, NULL);
+  timer_add(&b_, deadline(20), ignore_event, NULL);
+  timer_add(&c_, deadline(30), ignore_event, NULL);
+  timer_add(&d_, deadline(40), ignore_event, NULL);
+
+  // The next event becomes the head
+  EXPECT_TRUE(timer_cancel(&a_));
+  EXPECT_EQ(&b_, timer_first_event());
+
+  // Its neighbours are linked together
+  EXPECT_TRUE(timer_cancel(&c_));
+  EXPECT_EQ(&d_, b_.next);
+  EXPECT_EQ(NULL, c_.next);
+
+  // Events that aren't queued anymore are left alone
+  EXPECT_FALSE(timer_cancel(&a_));
+  EXPECT_FALSE(timer_cancel(&c_));
+  EXPECT_EQ(&b_, timer_first_event());
+
+  timer_cancel(&b_);
+  timer_cancel(&d_);
+  EXPECT_EQ(NULL, timer_first_event());
+}
+
+TEST(AddingQueuedEventMovesIt) {
+  timer_add(&a_, deadline(10), ignore_event, NULL);
+  timer_add(&b_, deadline(20), ignore_event, NULL);
+  timer_add(&c_, deadline(30), ignore_event, NULL);
+
+  // The head moves past the others, and is only queued once
+  timer_add(&a_, deadline(40), ignore_event, NULL);
+  EXPECT_EQ(&b_, timer_first_event());
+  EXPECT_EQ(&c_, b_.next);
+  EXPECT_EQ(&a_, c_.next);
+  EXPECT_EQ(NULL, a_.next);
+
+  timer_cancel(&a_);
+  timer_cancel(&b_);
+  timer_cancel(&c_);
+}
+
+END_SUITE();
+
+void test_timer() {
+  RUN_SUITE(TimerTest);
+  timer_cancel(&a_);
+  timer_cancel(&b_);
+  timer_cancel(&c_);
+  timer_cancel(&d_);
+}
@@ -0,0 +1,47 @@
+#include <asm.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libk/heap.h>
+#include <libk/memlayout.h>
+#include <test/tlb_bench.h>
+
+#define TLB_BENCH_PAGES 32
+#define TLB_BENCH_ROUNDS 1000
+
+// Average cycles of reloading CR3, as a context switch does, and then
+// reading a byte from each of the given pages
+static uint32_t cycles_per_switch(volatile char* pages) {
+  uint64_t start = rdtsc();
+  for (uint32_t round = 0; round < TLB_BENCH_ROUNDS; round++) {
+    write_cr3(read_cr3());
+    for (uint32_t page = 0; page < TLB_BENCH_PAGES; page++) {
+      (void)pages[page * PAGE_SIZE];
+    }
+  }
+  return (uint32_t)((rdtsc() - start) / TLB_BENCH_ROUNDS);
+}
+
+void bench_tlb() {
+  // Without global pages there is nothing to compare local pages with
+  if (!(read_cr4() & CR4_PGE)) {
+    printf("TLB bench: global pages are off, skipping\n");
+    return;
+  }
+
+  // Spans are mapped with 4KB pages, so each page needs its own TLB entry
+  char* pages = kmalloc(TLB_BENCH_PAGES * PAGE_SIZE);
+  memset(pages, 0, TLB_BENCH_PAGES * PAGE_SIZE);
+
+  // Toggling CR4.PGE flushes the whole TLB, global entries included
+  uint32_t cr4 = read_cr4();
+  write_cr4(cr4 & ~CR4_PGE);
+  uint32_t local_cycles = cycles_per_switch(pages);
+  write_cr4(cr4 | CR4_PGE);
+  uint32_t global_cycles = cycles_per_switch(pages);
+  write_cr4(cr4);
+
+  printf("TLB bench: CR3 switch + %u pages, %u cycles local, %u global\n",
+         TLB_BENCH_PAGES, local_cycles, global_cycles);
+  kfree(pages);
+}
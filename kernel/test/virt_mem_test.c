@@ -0,0 +1,224 @@
+#include <libk/phys_mem.h>
+#include <libk/virt_mem.h>
+#include <libk/vmem.h>
+#include <test/unit.h>
+
+// Far from where vmem hands out addresses, so the tests own these
+#define TEST_VIRT_ADDR (VMEM_VIRT_ADDR_END - 16 * PAGE_SIZE)
+
+// Not mapped by the kernel address space
+#define TEST_USER_VIRT_ADDR 0x40000000
+
+NEW_SUITE(VirtMemTest, 12);
+
+TEST(AllocRangeMapsEveryPage) {
+  EXPECT_TRUE(alloc_range(TEST_VIRT_ADDR, 4));
+  for (int i = 0; i < 4; i++) {
+    virtual_addr addr = TEST_VIRT_ADDR + i * PAGE_SIZE;
+    physical_addr block = virt_to_phys(addr);
+    EXPECT_TRUE(is_alloced(block));
+    EXPECT_EQ(block_to_page(block)->mapcount, 1);
+    *(uint32_t*)addr = i;
+  }
+  unmap_range(TEST_VIRT_ADDR, 4);
+}
+
+TEST(UnmapRangeFreesBlocks) {
+  EXPECT_TRUE(alloc_range(TEST_VIRT_ADDR, 2));
+  physical_addr first = virt_to_phys(TEST_VIRT_ADDR);
+  physical_addr second = virt_to_phys(TEST_VIRT_ADDR + PAGE_SIZE);
+
+  // Pages that aren't mapped are skipped
+  unmap_range(TEST_VIRT_ADDR, 3);
+  EXPECT_FALSE(is_alloced(first));
+  EXPECT_FALSE(is_alloced(second));
+}
+
+TEST(MapRangeMapsContiguousBlocks) {
+  physical_addr blocks = alloc_blocks(3);
+  EXPECT_TRUE(map_range(blocks, TEST_VIRT_ADDR, 3));
+  EXPECT_EQ(virt_to_phys(TEST_VIRT_ADDR + 2 * PAGE_SIZE + 5),
+            blocks + 2 * PAGE_SIZE + 5);
+  EXPECT_EQ(block_to_page(blocks + PAGE_SIZE)->mapcount, 1);
+
+  // Unmapping drops the reference alloc_blocks gave us
+  unmap_range(TEST_VIRT_ADDR, 3);
+  EXPECT_FALSE(is_alloced(blocks));
+}
+
+TEST(MapRangeFlushesReplacedMapping) {
+  virtual_addr first = TEST_VIRT_ADDR;
+  virtual_addr second = TEST_VIRT_ADDR + PAGE_SIZE;
+  EXPECT_TRUE(alloc_range(first, 2));
+  *(uint32_t*)first = 1;
+  *(uint32_t*)second = 2;
+
+  // Both pages end up sharing the second block, reads through the first
+  // must not hit its stale TLB entry
+  physical_addr old_block = virt_to_phys(first);
+  physical_addr block = virt_to_phys(second);
+  get_block(block);
+  EXPECT_TRUE(map_range(block, first, 1));
+  EXPECT_EQ(*(uint32_t*)first, 2);
+  EXPECT_EQ(block_to_page(block)->mapcount, 2);
+
+  unmap_range(first, 2);
+  EXPECT_FALSE(is_alloced(block));
+  free_block(old_block);
+}
+
+TEST(CreateAddressSpaceSharesKernelHalf) {
+  address_space* kernel = current_address_space();
+  address_space* space = create_address_space();
+  EXPECT_TRUE(space);
+
+  uint32_t value = 42;
+  physical_addr block = virt_to_phys((virtual_addr)&value);
+  switch_address_space(space);
+  EXPECT_EQ(virt_to_phys((virtual_addr)&value), block);
+  EXPECT_EQ(value, 42);
+  switch_address_space(kernel);
+
+  destroy_address_space(space);
+}
+
+TEST(AddressSpacesHaveTheirOwnUserHalf) {
+  address_space* kernel = current_address_space();
+  address_space* space = create_address_space();
+  switch_address_space(space);
+  EXPECT_TRUE(alloc_range(TEST_USER_VIRT_ADDR, 1));
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 7;
+
+  switch_address_space(kernel);
+  EXPECT_EQ(virt_to_phys(TEST_USER_VIRT_ADDR), (uint32_t)-1);
+
+  switch_address_space(space);
+  EXPECT_EQ(*(uint32_t*)TEST_USER_VIRT_ADDR, 7);
+  unmap_range(TEST_USER_VIRT_ADDR, 1);
+  switch_address_space(kernel);
+
+  destroy_address_space(space);
+}
+
+TEST(DestroyAddressSpaceFreesUserBlocks) {
+  address_space* kernel = current_address_space();
+  address_space* space = create_address_space();
+  switch_address_space(space);
+  EXPECT_TRUE(alloc_range(TEST_USER_VIRT_ADDR, 2));
+  physical_addr block = virt_to_phys(TEST_USER_VIRT_ADDR + PAGE_SIZE);
+  switch_address_space(kernel);
+
+  EXPECT_TRUE(is_alloced(block));
+  destroy_address_space(space);
+  EXPECT_FALSE(is_alloced(block));
+}
+
+TEST(CopyRangeCowSharesBlocksUntilWritten) {
+  address_space* kernel = current_address_space();
+  address_space* parent = create_address_space();
+  address_space* child = create_address_space();
+  switch_address_space(parent);
+  EXPECT_TRUE(alloc_range(TEST_USER_VIRT_ADDR, 1));
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 1;
+  physical_addr block = virt_to_phys(TEST_USER_VIRT_ADDR);
+
+  EXPECT_TRUE(copy_range_cow(child, TEST_USER_VIRT_ADDR, 1));
+  EXPECT_EQ(block_to_page(block)->refcount, 2);
+  EXPECT_EQ(block_to_page(block)->mapcount, 2);
+
+  // The child reads the shared block and gets a copy on its first write
+  switch_address_space(child);
+  EXPECT_EQ(virt_to_phys(TEST_USER_VIRT_ADDR), block);
+  EXPECT_EQ(*(uint32_t*)TEST_USER_VIRT_ADDR, 1);
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 2;
+  EXPECT_NE(virt_to_phys(TEST_USER_VIRT_ADDR), block);
+  EXPECT_EQ(block_to_page(block)->refcount, 1);
+
+  // The parent, now the only owner, writes to the block in place
+  switch_address_space(parent);
+  EXPECT_EQ(*(uint32_t*)TEST_USER_VIRT_ADDR, 1);
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 3;
+  EXPECT_EQ(virt_to_phys(TEST_USER_VIRT_ADDR), block);
+
+  switch_address_space(kernel);
+  destroy_address_space(child);
+  destroy_address_space(parent);
+  EXPECT_FALSE(is_alloced(block));
+}
+
+TEST(CopyRangeCowKeepsUserPages) {
+  address_space* kernel = current_address_space();
+  address_space* parent = create_address_space();
+  address_space* child = create_address_space();
+  switch_address_space(parent);
+  EXPECT_TRUE(alloc_range(TEST_USER_VIRT_ADDR, 1));
+  pt_entry* entry = ptable_lookup_entry(current_table(TEST_USER_VIRT_ADDR),
+                                        TEST_USER_VIRT_ADDR);
+  pt_entry_add_attrib(entry, I86_PTE_USER);
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 1;
+  EXPECT_TRUE(copy_range_cow(child, TEST_USER_VIRT_ADDR, 1));
+
+  // The child's table and page are reachable from user mode, and the
+  // parent's dirty bit isn't carried over
+  switch_address_space(child);
+  pd_entry table = *pdirectory_lookup_entry(current_directory(),
+                                            TEST_USER_VIRT_ADDR);
+  EXPECT_TRUE(pd_entry_is_user(table));
+  entry = ptable_lookup_entry(current_table(TEST_USER_VIRT_ADDR),
+                              TEST_USER_VIRT_ADDR);
+  bool user = *entry & I86_PTE_USER;
+  bool dirty = *entry & I86_PTE_DIRTY;
+  EXPECT_TRUE(user);
+  EXPECT_FALSE(dirty);
+
+  // So is the private copy the first write gets
+  *(uint32_t*)TEST_USER_VIRT_ADDR = 2;
+  user = *entry & I86_PTE_USER;
+  bool cow = pt_entry_is_cow(*entry);
+  EXPECT_TRUE(user);
+  EXPECT_FALSE(cow);
+  EXPECT_TRUE(pt_entry_is_writable(*entry));
+
+  switch_address_space(kernel);
+  destroy_address_space(child);
+  destroy_address_space(parent);
+}
+
+TEST(CopyRangeCowRejectsKernelRange) {
+  address_space* space = create_address_space();
+  EXPECT_FALSE(copy_range_cow(space, TEST_VIRT_ADDR, 1));
+  destroy_address_space(space);
+}
+
+TEST(AllocZeroedBlockPopsThePool) {
+  EXPECT_TRUE(refill_zero_pool());
+  physical_addr block = alloc_zeroed_block();
+  EXPECT_TRUE(block);
+
+  EXPECT_TRUE(map_range(block, TEST_VIRT_ADDR, 1));
+  uint32_t* words = (uint32_t*)TEST_VIRT_ADDR;
+  for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+    EXPECT_EQ(words[i], 0);
+  }
+  unmap_range(TEST_VIRT_ADDR, 1);
+  EXPECT_FALSE(is_alloced(block));
+}
+
+TEST(LazyPagesShareTheZeroPageUntilWritten) {
+  // Pages vmem handed out are backed on demand, reading maps the zero page
+  virtual_addr addr = vmem_alloc(1);
+  uint32_t* word = (uint32_t*)addr;
+  EXPECT_EQ(*word, 0);
+  physical_addr zero_page = virt_to_phys(addr);
+  EXPECT_TRUE(zero_page);
+
+  *word = 5;
+  EXPECT_NE(virt_to_phys(addr), zero_page);
+  EXPECT_EQ(*word, 5);
+  EXPECT_EQ(*(word + 1), 0);
+  vmem_free(addr, 1);
+}
+
+END_SUITE();
+
+void test_virt_mem() { RUN_SUITE(VirtMemTest); }
@@ -0,0 +1,72 @@
+#include <libk/phys_mem.h>
+#include <libk/virt_mem.h>
+#include <libk/vmem.h>
+#include <test/unit.h>
+
+NEW_SUITE(VMemTest, 6);
+
+TEST(AllocReturnsDisjointRanges) {
+  virtual_addr first = vmem_alloc(3);
+  virtual_addr second = vmem_alloc(2);
+  EXPECT_TRUE(first);
+  EXPECT_TRUE(second);
+  EXPECT_NE(first, second);
+  EXPECT_TRUE(vmem_is_alloced(first + 2 * PAGE_SIZE));
+  EXPECT_TRUE(vmem_is_alloced(second + PAGE_SIZE));
+  vmem_free(first, 3);
+  vmem_free(second, 2);
+  EXPECT_FALSE(vmem_is_alloced(first));
+}
+
+TEST(FreeReusesAddresses) {
+  virtual_addr first = vmem_alloc(4);
+  vmem_free(first, 4);
+  virtual_addr second = vmem_alloc(4);
+  EXPECT_EQ(first, second);
+  vmem_free(second, 4);
+}
+
+TEST(FreeGivesBackBlocks) {
+  virtual_addr addr = vmem_alloc(2);
+  EXPECT_TRUE(alloc_range(addr, 2));
+  physical_addr block = virt_to_phys(addr + PAGE_SIZE);
+  EXPECT_TRUE(is_alloced(block));
+  vmem_free(addr, 2);
+  EXPECT_FALSE(is_alloced(block));
+}
+
+TEST(ExtendGrowsIntoFreePages) {
+  virtual_addr addr = vmem_alloc(2);
+  EXPECT_TRUE(vmem_extend(addr, 2, 5));
+  EXPECT_TRUE(vmem_is_alloced(addr + 4 * PAGE_SIZE));
+  vmem_free(addr, 5);
+}
+
+TEST(ExtendFailsIntoTakenPages) {
+  virtual_addr addr = vmem_alloc(2);
+  virtual_addr next = vmem_alloc(1);
+  EXPECT_EQ(next, addr + 2 * PAGE_SIZE);
+  EXPECT_FALSE(vmem_extend(addr, 2, 3));
+  vmem_free(next, 1);
+  vmem_free(addr, 2);
+}
+
+TEST(MapDeviceMapsGivenBlocks) {
+  // VGA text memory, also identity mapped
+  virtual_addr addr = vmem_map_device(0xB8000, 1);
+  EXPECT_TRUE(addr);
+  EXPECT_EQ(virt_to_phys(addr + 8), 0xB8008);
+  EXPECT_EQ(*(uint16_t*)addr, *(uint16_t*)0xB8000);
+
+  // Device registers must not be cached
+  pt_entry entry = *ptable_lookup_entry(current_table(addr), addr);
+  uint32_t uncached = I86_PTE_NOT_CACHEABLE | I86_PTE_WRITETHOUGH;
+  uint32_t cache_bits = entry & uncached;
+  EXPECT_EQ(cache_bits, uncached);
+  vmem_free(addr, 1);
+  EXPECT_TRUE(is_alloced(0xB8000));
+}
+
+END_SUITE();
+
+void test_vmem() { RUN_SUITE(VMemTest); }
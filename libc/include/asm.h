@@ -22,10 +22,83 @@ inline uint8_t inb(uint16_t port) {
 
 inline void enable_interrupts(void) { asm volatile("sti"); }
 
-inline void disable_interrupts(void) { asm volatile("sti"); }
+inline void disable_interrupts(void) { asm volatile("cli"); }
+
+// Disables interrupts, returning EFLAGS so restore_interrupts can turn them
+// back on only if they were on. Safe to nest and to use in IRQ handlers.
+inline uint32_t save_interrupts(void) {
+  uint32_t eflags;
+  asm volatile("pushf\n\tpop %0\n\tcli" : "=r"(eflags) : : "memory");
+  return eflags;
+}
+
+inline void restore_interrupts(uint32_t eflags) {
+  asm volatile("push %0\n\tpopf" : : "r"(eflags) : "memory", "cc");
+}
 
 inline void invlpg(void* m) {
   asm volatile("invlpg (%0)" : : "b"(m) : "memory");
 }
 
+// Control register 4 bits
+#define CR4_PSE 0x10  // 4MB pages
+#define CR4_PGE 0x80  // Global pages, kept in the TLB across CR3 reloads
+
+// Holds the address that caused the last page fault
+inline uint32_t read_cr2(void) {
+  uint32_t ret;
+  asm volatile("mov %%cr2, %0" : "=r"(ret));
+  return ret;
+}
+
+inline uint32_t read_cr3(void) {
+  uint32_t ret;
+  asm volatile("mov %%cr3, %0" : "=r"(ret));
+  return ret;
+}
+
+// Also flushes every TLB entry that isn't global
+inline void write_cr3(uint32_t val) {
+  asm volatile("mov %0, %%cr3" : : "r"(val) : "memory");
+}
+
+inline uint32_t read_cr4(void) {
+  uint32_t ret;
+  asm volatile("mov %%cr4, %0" : "=r"(ret));
+  return ret;
+}
+
+inline void write_cr4(uint32_t val) {
+  asm volatile("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+inline uint64_t rdtsc(void) {
+  uint64_t ret;
+  asm volatile("rdtsc" : "=A"(ret));
+  return ret;
+}
+
+// CPUID feature bits
+#define CPUID_EDX_TSC 0x10             // Leaf 1, rdtsc is available
+#define CPUID_EDX_APIC 0x200           // Leaf 1, there is a local APIC
+#define CPUID_EDX_PGE 0x2000           // Leaf 1, CR4.PGE and global pages
+#define CPUID_EDX_INVARIANT_TSC 0x100  // Leaf 0x80000007, constant TSC rate
+
+// Stores the eax, ebx, ecx and edx CPUID returns for leaf in regs
+inline void cpuid(uint32_t leaf, uint32_t regs[4]) {
+  asm volatile("cpuid"
+               : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+               : "a"(leaf), "c"(0));
+}
+
+inline uint64_t rdmsr(uint32_t msr) {
+  uint64_t ret;
+  asm volatile("rdmsr" : "=A"(ret) : "c"(msr));
+  return ret;
+}
+
+inline void wrmsr(uint32_t msr, uint64_t val) {
+  asm volatile("wrmsr" : : "c"(msr), "A"(val));
+}
+
 #endif  // _LIBC_ASM_H_
\ No newline at end of file